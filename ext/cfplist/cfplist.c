@@ -7,9 +7,14 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include <CommonCrypto/CommonDigest.h>
 #include <CoreFoundation/CoreFoundation.h>
 
+#include <math.h>
+#include <time.h>
+
 #include "ruby.h"
+#include "ruby/encoding.h"
 #include "ruby/intern.h"
 #include "ruby/ruby.h"
 
@@ -17,16 +22,16 @@
  *                                   Macros                                    *
  *******************************************************************************/
 
-#define CF2RB(X) corefoundation_to_ruby((X))
-#define CFSTR2RB(STR) rb_CFString_convert((STR))
-#define CFDATA2RB(D) rb_CFData_convert((D))
+#define CF2RB(X, L) corefoundation_to_ruby((X), (L))
+#define CFSTR2RB(STR, L) rb_CFString_convert((STR), (L))
+#define CFDATA2RB(D, L) rb_CFData_convert((D), (L))
 #define CFDATE2RB(D) rb_CFDate_convert((D))
 #define CFBOOL2RB(B) rb_CFBoolean_convert((B))
 #define CFNUM2RB(N) rb_CFNumber_convert((N))
-#define CFARR2RB(A) rb_CFArray_convert((A))
-#define CFDICT2RB(D) rb_CFDictionary_convert((D))
+#define CFARR2RB(A, L) rb_CFArray_convert((A), (L))
+#define CFDICT2RB(D, K, L) rb_CFDictionary_convert((D), (K), (L))
 
-#define CFSTR2SYM(STR) rb_to_symbol(rb_CFString_convert((STR)))
+#define CFSTR2SYM(STR, L) rb_to_symbol(rb_CFString_convert((STR), (L)))
 #define CFINTERN(X) rb_CFString_intern((X))
 
 #define cfcheckmem(PTR, M, ...)                                                \
@@ -42,8 +47,10 @@
  *                                Declarations                                 *
  *******************************************************************************/
 
+struct cfplist_limits;
+
 static VALUE
-corefoundation_to_ruby(CFTypeRef cf_type);
+corefoundation_to_ruby(CFTypeRef cf_type, struct cfplist_limits *limits);
 
 static CFTypeRef
 ruby_to_corefoundation(VALUE obj);
@@ -51,12 +58,531 @@ ruby_to_corefoundation(VALUE obj);
 static void
 rb_raise_CFError(CFErrorRef error);
 
+static CFPropertyListRef
+plist_create(VALUE plist_str, const struct cfplist_limits *limits);
+
 VALUE rb_mCFPlist;
 VALUE rb_eCFError;
 VALUE rb_eCFErrorOSStatus;
 VALUE rb_eCFErrorMach;
 VALUE rb_eCFErrorCocoa;
-static ID id_to_s, id_keys, id_vals, id_count;
+VALUE rb_eCFErrorLimit;
+VALUE rb_eCFErrorFormat;
+static ID id_to_s, id_keys, id_vals, id_count, id_lshift;
+static ID id_max_bytes, id_max_objects, id_max_string_bytes, id_max_depth,
+    id_max_total_output;
+static ID id_format, id_canonical, id_xml, id_binary;
+static ID id_sha1, id_sha256, id_sha512;
+static ID id_added, id_removed, id_changed;
+static rb_encoding *enc_utf16be;
+
+/*******************************************************************************
+ *                               Resource Limits                               *
+ *******************************************************************************/
+
+/*
+ * Limits on how much work a single call to CFPlist.parse may do, along with
+ * the running totals we check them against. These exist so that untrusted
+ * input can't make us build an arbitrarily large ruby object graph. A limit of
+ * LONG_MAX means the caller didn't ask for one.
+ *
+ * A NULL `struct cfplist_limits *` is accepted everywhere one is expected, and
+ * means "no limits at all" (e.g. when we convert our own generated output).
+ */
+struct cfplist_limits {
+  long max_bytes;        /* size of the serialized input */
+  long max_objects;      /* total number of decoded objects, including keys */
+  long max_string_bytes; /* size of any one string or data object */
+  long max_depth;        /* nesting depth of arrays and dictionaries */
+  long max_total_output; /* sum of the sizes of all strings and data objects */
+
+  long objects;      /* objects decoded so far */
+  long depth;        /* current nesting depth */
+  long total_output; /* string and data bytes decoded so far */
+};
+
+/* Raises a CFPlist::LimitError for the option named `name`. */
+static void
+cfplist_raise_limit(const char *name, long limit)
+{
+  rb_raise(rb_eCFErrorLimit, "plist exceeds :%s (%ld)", name, limit);
+}
+
+/* Adds two non-negative longs, clamping at LONG_MAX rather than overflowing */
+static inline long
+cfplist_sat_add(long a, long b)
+{
+  return (a > LONG_MAX - b) ? LONG_MAX : a + b;
+}
+
+/* Fetch a single limit from the options hash, or LONG_MAX if not given. */
+static long
+cfplist_limit_opt(VALUE opts, ID key)
+{
+  VALUE val = rb_hash_lookup2(opts, ID2SYM(key), Qnil);
+  if (NIL_P(val))
+    return LONG_MAX;
+
+  long limit = NUM2LONG(val);
+  if (limit < 0) {
+    rb_raise(rb_eArgError, ":%" PRIsVALUE " must not be negative",
+             rb_id2str(key));
+  }
+  return limit;
+}
+
+static void
+cfplist_limits_init(struct cfplist_limits *limits, VALUE opts)
+{
+  MEMZERO(limits, struct cfplist_limits, 1);
+
+  if (NIL_P(opts))
+    opts = rb_hash_new();
+  Check_Type(opts, T_HASH);
+
+  limits->max_bytes = cfplist_limit_opt(opts, id_max_bytes);
+  limits->max_objects = cfplist_limit_opt(opts, id_max_objects);
+  limits->max_string_bytes = cfplist_limit_opt(opts, id_max_string_bytes);
+  limits->max_depth = cfplist_limit_opt(opts, id_max_depth);
+  limits->max_total_output = cfplist_limit_opt(opts, id_max_total_output);
+}
+
+/* Account for one more decoded object. */
+static inline void
+cfplist_limits_count_object(struct cfplist_limits *limits)
+{
+  if (limits == NULL)
+    return;
+
+  limits->objects = cfplist_sat_add(limits->objects, 1);
+  if (limits->objects > limits->max_objects) {
+    cfplist_raise_limit("max_objects", limits->max_objects);
+  }
+}
+
+/* Account for a string or data object of `nbytes` bytes. This is called
+ * before we copy anything, so an oversized object is never allocated. */
+static inline void
+cfplist_limits_count_bytes(struct cfplist_limits *limits, long nbytes)
+{
+  if (limits == NULL)
+    return;
+
+  if (nbytes > limits->max_string_bytes) {
+    cfplist_raise_limit("max_string_bytes", limits->max_string_bytes);
+  }
+
+  limits->total_output = cfplist_sat_add(limits->total_output, nbytes);
+  if (limits->total_output > limits->max_total_output) {
+    cfplist_raise_limit("max_total_output", limits->max_total_output);
+  }
+}
+
+/* Enter an array or dictionary. */
+static inline void
+cfplist_limits_push(struct cfplist_limits *limits)
+{
+  if (limits == NULL)
+    return;
+
+  if (++limits->depth > limits->max_depth) {
+    cfplist_raise_limit("max_depth", limits->max_depth);
+  }
+}
+
+/* Leave an array or dictionary. */
+static inline void
+cfplist_limits_pop(struct cfplist_limits *limits)
+{
+  if (limits != NULL)
+    limits->depth--;
+}
+
+/* Start the running totals over, e.g. before checking another input. */
+static inline void
+cfplist_limits_reset(struct cfplist_limits *limits)
+{
+  limits->objects = 0;
+  limits->depth = 0;
+  limits->total_output = 0;
+}
+
+/*******************************************************************************
+ *                        Binary Property List Scanning                        *
+ *******************************************************************************/
+
+/*
+ * Objects in a binary plist refer to each other by index, so a small file can
+ * refer to the same subtree any number of times. CoreFoundation shares those
+ * objects, but every reference becomes a separate ruby object when we convert
+ * the result, so a few hundred bytes of input can expand into billions of
+ * objects. A reference cycle is only noticed by CoreFoundation after it has
+ * done most of the work of decoding.
+ *
+ * Before we hand a binary plist to CoreFoundation, we walk its object graph
+ * ourselves, without decoding any values, to reject cycles and to work out how
+ * large the fully expanded tree would be. Shared subtrees are only walked
+ * once, so this is linear in the size of the input.
+ *
+ * The walk is deliberately conservative. It only raises a LimitError when the
+ * decoded result would definitely exceed a limit (string sizes are lower
+ * bounds), and it gives up quietly on anything it doesn't understand, leaving
+ * CoreFoundation to report the real error.
+ */
+
+#define BPLIST_HEADER "bplist00"
+#define BPLIST_HEADER_LEN 8
+#define BPLIST_TRAILER_LEN 32
+
+/* Colors for the depth-first walk */
+enum {
+  BPLIST_WHITE = 0, /* not visited yet */
+  BPLIST_GREY,      /* on the current path, i.e. an ancestor */
+  BPLIST_BLACK      /* finished, along with everything below it */
+};
+
+/* Totals for the fully expanded subtree rooted at an object */
+struct bplist_stats {
+  long objects;
+  long depth;
+  long output;
+};
+
+/* An array or dictionary whose children we are still walking */
+struct bplist_frame {
+  uint64_t obj;   /* index of the collection */
+  uint64_t refs;  /* offset of its first object ref */
+  uint64_t nrefs; /* number of object refs (2 * count for a dictionary) */
+  uint64_t next;  /* index of the next ref to visit */
+};
+
+struct bplist_scan {
+  const uint8_t *bytes;
+  uint64_t len;
+
+  /* These come from the trailer at the end of the file */
+  uint8_t offset_size;
+  uint8_t ref_size;
+  uint64_t num_objects;
+  uint64_t top_object;
+  uint64_t offset_table;
+
+  const struct cfplist_limits *limits;
+  uint8_t *color;             /* one of BPLIST_{WHITE,GREY,BLACK} per object */
+  struct bplist_stats *stats; /* NULL unless a limit needs them */
+  struct bplist_frame *stack; /* the current path from the top object */
+  long stack_len, stack_capa;
+};
+
+/* Read a big-endian unsigned integer of `nbytes` (at most 8) bytes. */
+static inline uint64_t
+bplist_read_uint(const uint8_t *ptr, uint8_t nbytes)
+{
+  uint64_t result = 0;
+  uint8_t i;
+
+  for (i = 0; i < nbytes; i++)
+    result = (result << 8) | ptr[i];
+
+  return result;
+}
+
+/* Read and sanity-check the trailer. Returns false if it is malformed. */
+static Boolean
+bplist_read_trailer(struct bplist_scan *scan)
+{
+  if (scan->len < BPLIST_HEADER_LEN + 1 + BPLIST_TRAILER_LEN)
+    return false;
+
+  const uint64_t table_end = scan->len - BPLIST_TRAILER_LEN;
+  const uint8_t *trailer = scan->bytes + table_end;
+
+  /* the first 6 bytes are unused, or hold a sort version we don't care about */
+  scan->offset_size = trailer[6];
+  scan->ref_size = trailer[7];
+  scan->num_objects = bplist_read_uint(trailer + 8, 8);
+  scan->top_object = bplist_read_uint(trailer + 16, 8);
+  scan->offset_table = bplist_read_uint(trailer + 24, 8);
+
+  if (scan->offset_size < 1 || scan->offset_size > 8)
+    return false;
+  if (scan->ref_size < 1 || scan->ref_size > 8)
+    return false;
+  if (scan->num_objects < 1 || scan->top_object >= scan->num_objects)
+    return false;
+  if (scan->offset_table <= BPLIST_HEADER_LEN ||
+      scan->offset_table >= table_end)
+    return false;
+
+  /* the offset table has to fit between its start and the trailer */
+  return scan->num_objects <=
+         (table_end - scan->offset_table) / scan->offset_size;
+}
+
+/* Look up the offset of object `obj` in the offset table. */
+static Boolean
+bplist_object_offset(const struct bplist_scan *scan, uint64_t obj,
+                     uint64_t *offset)
+{
+  const uint8_t *entry =
+      scan->bytes + scan->offset_table + obj * scan->offset_size;
+  *offset = bplist_read_uint(entry, scan->offset_size);
+
+  /* objects live between the header and the offset table */
+  return *offset >= BPLIST_HEADER_LEN && *offset < scan->offset_table;
+}
+
+/*
+ * Read the marker byte of the object at `offset`, and for data, strings and
+ * collections, the count that goes with it. On return, `*payload` is the
+ * offset of the first byte after the marker and count.
+ */
+static Boolean
+bplist_read_header(const struct bplist_scan *scan, uint64_t offset,
+                   uint8_t *marker, uint64_t *count, uint64_t *payload)
+{
+  const uint64_t end = scan->offset_table;
+
+  *marker = scan->bytes[offset];
+  *count = *marker & 0x0F;
+  *payload = offset + 1;
+
+  if (*count != 0x0F)
+    return true;
+
+  switch (*marker >> 4) {
+  case 0x4: /* data */
+  case 0x5: /* ASCII string */
+  case 0x6: /* UTF-16 string */
+  case 0xA: /* array */
+  case 0xB: /* ordered set */
+  case 0xC: /* set */
+  case 0xD: /* dictionary */
+    break;
+  default:
+    return true; /* 0x0F is just part of the marker */
+  }
+
+  /* The count didn't fit in the marker, so it follows as an int object */
+  if (*payload >= end)
+    return false;
+
+  uint8_t int_marker = scan->bytes[*payload];
+  if ((int_marker >> 4) != 0x1 || (int_marker & 0x0F) > 3)
+    return false;
+
+  uint8_t nbytes = 1 << (int_marker & 0x0F);
+  if (end - *payload - 1 < nbytes)
+    return false;
+
+  *count = bplist_read_uint(scan->bytes + *payload + 1, nbytes);
+  *payload += 1 + nbytes;
+  return true;
+}
+
+/*
+ * Add the totals for the finished object `child` to those of the collection
+ * at `scan->stack[parent]`, and check the result against our limits.
+ *
+ * Any subtree's totals are a lower bound for the whole document's, so we can
+ * raise as soon as one of them is over.
+ */
+static void
+bplist_scan_fold(struct bplist_scan *scan, long parent, uint64_t child)
+{
+  if (scan->stats == NULL)
+    return;
+
+  const struct cfplist_limits *limits = scan->limits;
+  struct bplist_stats *p = &scan->stats[scan->stack[parent].obj];
+  const struct bplist_stats *c = &scan->stats[child];
+
+  p->objects = cfplist_sat_add(p->objects, c->objects);
+  if (p->objects > limits->max_objects)
+    cfplist_raise_limit("max_objects", limits->max_objects);
+
+  /* `parent` is also the number of ancestors the parent has */
+  if (c->depth + 1 > p->depth)
+    p->depth = c->depth + 1;
+  if (cfplist_sat_add(parent, p->depth) > limits->max_depth)
+    cfplist_raise_limit("max_depth", limits->max_depth);
+
+  p->output = cfplist_sat_add(p->output, c->output);
+  if (p->output > limits->max_total_output)
+    cfplist_raise_limit("max_total_output", limits->max_total_output);
+}
+
+/*
+ * Start visiting object `obj`. Scalars are finished straight away; arrays and
+ * dictionaries are pushed onto the stack so that we can walk their children.
+ * Returns false if the object is malformed.
+ */
+static Boolean
+bplist_scan_enter(struct bplist_scan *scan, uint64_t obj)
+{
+  const struct cfplist_limits *limits = scan->limits;
+  uint64_t offset, count, payload, nbytes = 0, nrefs;
+  uint8_t marker;
+
+  if (!bplist_object_offset(scan, obj, &offset) ||
+      !bplist_read_header(scan, offset, &marker, &count, &payload))
+    return false;
+
+  const uint64_t avail = scan->offset_table - payload;
+
+  switch (marker >> 4) {
+  case 0x4: /* data */
+  case 0x5: /* ASCII string */
+    if (count > avail)
+      return false;
+    nbytes = count;
+    break;
+
+  case 0x6: /* UTF-16 string, which is at least 1 UTF-8 byte per code unit */
+    if (count > avail / 2)
+      return false;
+    nbytes = count;
+    break;
+
+  case 0xA: /* array */
+  case 0xB: /* ordered set */
+  case 0xC: /* set */
+  case 0xD: /* dictionary, which has a key ref and a value ref per entry */
+    nrefs = ((marker >> 4) == 0xD) ? count * 2 : count;
+    if (count > avail || nrefs > avail / scan->ref_size)
+      return false;
+
+    if (scan->stack_len == scan->stack_capa) {
+      scan->stack_capa = scan->stack_capa ? scan->stack_capa * 2 : 16;
+      REALLOC_N(scan->stack, struct bplist_frame, scan->stack_capa);
+    }
+
+    scan->stack[scan->stack_len].obj = obj;
+    scan->stack[scan->stack_len].refs = payload;
+    scan->stack[scan->stack_len].nrefs = nrefs;
+    scan->stack[scan->stack_len].next = 0;
+    scan->stack_len++;
+
+    if (scan->stack_len > limits->max_depth)
+      cfplist_raise_limit("max_depth", limits->max_depth);
+
+    scan->color[obj] = BPLIST_GREY;
+    if (scan->stats != NULL) {
+      scan->stats[obj].objects = 1;
+      scan->stats[obj].depth = 1;
+      scan->stats[obj].output = 0;
+    }
+    return true;
+
+  default:
+    break;
+  }
+
+  if (nbytes > (uint64_t)limits->max_string_bytes)
+    cfplist_raise_limit("max_string_bytes", limits->max_string_bytes);
+
+  scan->color[obj] = BPLIST_BLACK;
+  if (scan->stats != NULL) {
+    scan->stats[obj].objects = 1;
+    scan->stats[obj].depth = 0;
+    scan->stats[obj].output = (long)nbytes; /* nbytes <= scan->len */
+  }
+  return true;
+}
+
+/* The body of bplist_scan(), run under rb_ensure. */
+static VALUE
+bplist_scan_walk(VALUE arg)
+{
+  struct bplist_scan *scan = (struct bplist_scan *)arg;
+  const struct cfplist_limits *limits = scan->limits;
+
+  scan->color = ZALLOC_N(uint8_t, scan->num_objects);
+  if (limits->max_objects != LONG_MAX || limits->max_depth != LONG_MAX ||
+      limits->max_total_output != LONG_MAX) {
+    scan->stats = ALLOC_N(struct bplist_stats, scan->num_objects);
+  }
+
+  if (!bplist_scan_enter(scan, scan->top_object))
+    return Qfalse;
+
+  while (scan->stack_len > 0) {
+    struct bplist_frame *frame = &scan->stack[scan->stack_len - 1];
+
+    /* All of this collection's children are done, so it is too */
+    if (frame->next == frame->nrefs) {
+      uint64_t obj = frame->obj;
+      scan->color[obj] = BPLIST_BLACK;
+      if (--scan->stack_len > 0)
+        bplist_scan_fold(scan, scan->stack_len - 1, obj);
+      continue;
+    }
+
+    uint64_t child = bplist_read_uint(
+        scan->bytes + frame->refs + frame->next * scan->ref_size,
+        scan->ref_size);
+    frame->next++;
+
+    if (child >= scan->num_objects)
+      return Qfalse;
+
+    switch (scan->color[child]) {
+    case BPLIST_GREY:
+      rb_raise(rb_eCFErrorFormat, "binary plist contains a reference cycle");
+
+    case BPLIST_WHITE:
+      if (!bplist_scan_enter(scan, child))
+        return Qfalse;
+      if (scan->color[child] == BPLIST_GREY)
+        break; /* it gets folded in when it's popped off the stack */
+      /* fallthrough */
+
+    default:
+      bplist_scan_fold(scan, scan->stack_len - 1, child);
+      break;
+    }
+  }
+
+  return Qtrue;
+}
+
+/* Frees the scratch space used by bplist_scan_walk(). */
+static VALUE
+bplist_scan_free(VALUE arg)
+{
+  struct bplist_scan *scan = (struct bplist_scan *)arg;
+
+  xfree(scan->color);
+  xfree(scan->stats);
+  xfree(scan->stack);
+
+  return Qnil;
+}
+
+/*
+ * If `bytes` holds a binary plist, raise a FormatError if it contains a
+ * reference cycle, or a LimitError if it would decode to more than `limits`
+ * allow. Does nothing for any other kind of input.
+ */
+static void
+bplist_scan(const uint8_t *bytes, long len, const struct cfplist_limits *limits)
+{
+  struct bplist_scan scan;
+  MEMZERO(&scan, struct bplist_scan, 1);
+
+  if (len < BPLIST_HEADER_LEN ||
+      memcmp(bytes, BPLIST_HEADER, BPLIST_HEADER_LEN) != 0)
+    return;
+
+  scan.bytes = bytes;
+  scan.len = (uint64_t)len;
+  scan.limits = limits;
+
+  if (!bplist_read_trailer(&scan))
+    return;
+
+  rb_ensure(bplist_scan_walk, (VALUE)&scan, bplist_scan_free, (VALUE)&scan);
+}
 
 /*******************************************************************************
  *                     CoreFoundation Type => Ruby Object                      *
@@ -69,37 +595,35 @@ static ID id_to_s, id_keys, id_vals, id_count;
  * don't "own" these objects, and their memory could be freed by
  * CoreFoundation at any time.
  *
- * Even though the function we call hash 'Get' in the name, it does
- * actually perform a copy of the string, according to the documentation.
+ * We don't retain the string here, because the caller holds a reference to
+ * the plist it came from until we are done, and we may raise part way through
+ * (which would leak the retain).
  */
 static inline VALUE
-rb_CFString_convert(CFStringRef str)
+rb_CFString_convert(CFStringRef str, struct cfplist_limits *limits)
 {
-  CFRetain(str); /* retain the string for the duration of this function */
-
-  CFIndex len = CFStringGetLength(str); /* get length of string */
-  CFIndex buflen = len + 1; /* size of our char buffer, plus NULL terminator */
-
-  /*
-   * Allocate a char buffer to hold the string. Size is 1+len to account for the
-   * null terminator. sizeof(char) is 1, but I feel this more accurately depicts
-   * what we are doing.
-   */
-  char *cstr = calloc((1 + len), sizeof(char));
-
-  Boolean success;
-  /* get the characters from the string, using UTF8 encoding. */
-  success = CFStringGetCString(str, cstr, buflen, kCFStringEncodingUTF8);
-
-  if (!success) {
+  CFIndex len = CFStringGetLength(str); /* length in UTF-16 code units */
+  CFRange rng = CFRangeMake(0, len);    /* range of characters (i.e. all) */
+  CFIndex nbytes = 0;                   /* length in UTF-8 bytes */
+
+  /* Measure the string first, without copying anything, so that we can check
+   * it against our limits before allocating a buffer for it. */
+  CFStringGetBytes(str, rng, kCFStringEncodingUTF8, 0, false, NULL, 0,
+                   &nbytes);
+  cfplist_limits_count_bytes(limits, nbytes);
+
+  /* Now copy the characters straight into a new ruby string */
+  VALUE result = rb_utf8_str_new(NULL, nbytes);
+  CFIndex converted =
+      CFStringGetBytes(str, rng, kCFStringEncodingUTF8, 0, false,
+                       (UInt8 *)RSTRING_PTR(result), nbytes, NULL);
+
+  if (converted != len) {
     /* TODO: Raise a better error here. */
     rb_raise(rb_eRuntimeError, "Unable to convert string to UTF8");
   }
 
-  CFRelease(str); /* matches retain from the beginning of this function. */
-
-  /* Let ruby know this string is UTF8 encoded. */
-  return rb_utf8_str_new(cstr, (long)len);
+  return result;
 }
 
 /* This isn't ideal, but since Ruby handles unknown byte sequences as a string,
@@ -109,13 +633,16 @@ rb_CFString_convert(CFStringRef str)
  * TODO: Figure out a safe way to Marshal this data
  */
 static inline VALUE
-rb_CFData_convert(CFDataRef data)
+rb_CFData_convert(CFDataRef data, struct cfplist_limits *limits)
 {
-  CFRetain(data); /* retain the data for the duration of this function */
-
   CFIndex len = CFDataGetLength(data); /* get length of data, in bytes */
   CFRange rng = CFRangeMake(0, len);   /* range of bytes to copy (i.e. all) */
 
+  /* check this before we allocate anything, or even retain the data */
+  cfplist_limits_count_bytes(limits, len);
+
+  CFRetain(data); /* retain the data for the duration of this function */
+
   /* allocate our data buffer on the heap, unlike the analogous CFString
    * function, we don't need to account for a NUL terminator
    */
@@ -127,7 +654,9 @@ rb_CFData_convert(CFDataRef data)
 
   CFRelease(data); /* matches retain above */
   /* return a tainted string, because this data could be literally anything */
-  return rb_tainted_str_new((const char *)databuf, len);
+  VALUE result = rb_tainted_str_new((const char *)databuf, len);
+  free(databuf); /* the ruby string has its own copy */
+  return result;
 }
 
 /* why is CFBoolean a thing? I think this one is pretty self-explanatory. */
@@ -141,66 +670,59 @@ rb_CFBoolean_convert(CFBooleanRef boolean)
   return Qfalse;
 }
 
+/*
+ * Binary plists can hold 16-byte integers, which CoreFoundation reads with a
+ * private number type that CFNumberGetType() reports as kCFNumberSInt64Type.
+ * Its own binary plist writer gets them back out like this, and so do we.
+ */
+#define CFPLIST_NUMBER_SINT128_TYPE ((CFNumberType)17)
+
+struct cfplist_sint128 {
+  int64_t high;
+  uint64_t low;
+};
+
 /*
  * Convert a CFNumber into a ruby number.
+ *
+ * We ask CoreFoundation for either a double or a 64-bit integer, rather than
+ * the number's own type, so that the value always fits the variable we read
+ * it into. Only integers too big for that are read as 128 bits.
  */
 static inline VALUE
 rb_CFNumber_convert(CFNumberRef number)
 {
-  CFRetain(number); /* retain for the duration of this function */
-  intptr_t rawval;  /* get a value big enough to hold a pointer to an int */
-  CFNumberType num_type = CFNumberGetType(number); /* what kind of number? */
-  Boolean success = CFNumberGetValue(number, num_type, &rawval);
-  VALUE result = Qnil; /* assume it will be nil, in case we can't convert */
-
-  if (!success) {
-    CFRelease(number);
-    return result; /* TODO: raise here? */
+  if (CFNumberIsFloatType(number)) { /* float, double, or CGFloat */
+    double dval;
+    if (!CFNumberGetValue(number, kCFNumberDoubleType, &dval))
+      return Qnil; /* TODO: raise here? */
+    return DBL2NUM(dval);
   }
 
-  switch (num_type) {
-  case kCFNumberSInt8Type:     /* char */
-  case kCFNumberCharType:      /* char */
-    result = LONG2FIX(rawval); /* smaller than 32-bit, so use FIXNUM */
-    break;
-
-  case kCFNumberShortType:    /* short */
-  case kCFNumberSInt16Type:   /* short */
-  case kCFNumberSInt32Type:   /* int */
-  case kCFNumberIntType:      /* int */
-    result = INT2FIX(rawval); /* smaller than 32-bit, so use FIXNUM */
-    break;
-
-  case kCFNumberLongType:      /* long */
-  case kCFNumberNSIntegerType: /* long */
-  case kCFNumberCFIndexType:   /* signed long */
-    result = LONG2NUM(rawval); /* maybe 64-bit, so use Numeric */
-    break;
-
-  case kCFNumberSInt64Type:   /* long long */
-  case kCFNumberLongLongType: /* long long */
-    result = LL2NUM(rawval);  /* maybe 64-bit, so use Numeric */
-    break;
+  long long llval; /* any of the integer types */
+  if (CFNumberGetValue(number, kCFNumberLongLongType, &llval))
+    return LL2NUM(llval);
 
-  case kCFNumberFloatType:    /* float */
-  case kCFNumberDoubleType:   /* double */
-  case kCFNumberFloat64Type:  /* 64-bit floating point (MacTypes.h)*/
-  case kCFNumberFloat32Type:  /* 32-bit floating point (MacTypes.h)*/
-  case kCFNumberCGFloatType:  /* float or double */
-    result = DBL2NUM(rawval); /* maybe 64-bit, so use Numeric */
-    break;
-  }
+  struct cfplist_sint128 wide;
+  if (!CFNumberGetValue(number, CFPLIST_NUMBER_SINT128_TYPE, &wide))
+    return Qnil; /* TODO: raise here? */
 
-  CFRelease(number); /* matches retain above */
-  return result;
+  VALUE high = rb_funcall(LL2NUM(wide.high), id_lshift, 1, INT2FIX(64));
+  return rb_funcall(high, '+', 1, ULL2NUM(wide.low));
 }
 
+/*
+ * Like rb_CFString_convert, the collection converters don't retain their
+ * argument, since a limit may be hit (and an exception raised) part way
+ * through converting it.
+ */
 static VALUE
-rb_CFArray_convert(CFArrayRef array)
+rb_CFArray_convert(CFArrayRef array, struct cfplist_limits *limits)
 {
-  CFRetain(array); /* retain for the duration of this function */
   CFIndex i, count = CFArrayGetCount(array); /* number of elements in array */
 
+  cfplist_limits_push(limits);
+
   /* faster to allocate the memory for our ruby array in one shot */
   VALUE result = rb_ary_new_capa(count);
 
@@ -208,20 +730,23 @@ rb_CFArray_convert(CFArrayRef array)
   for (i = 0; i < count; i++) {
     CFTypeRef val = CFArrayGetValueAtIndex(array, i);
     /* NOTE: this macro copies the memory of the values */
-    rb_ary_push(result, CF2RB(val));
+    rb_ary_push(result, CF2RB(val, limits));
   }
 
-  CFRelease(array); /* matches retain above */
+  cfplist_limits_pop(limits);
 
   return result;
 }
 
 static VALUE
-rb_CFDictionary_convert(CFDictionaryRef dict, bool keys2sym)
+rb_CFDictionary_convert(CFDictionaryRef dict, bool keys2sym,
+                        struct cfplist_limits *limits)
 {
-  CFRetain(dict);                                /* retain for the duration */
   VALUE result = rb_hash_new();                  /* create a new hash */
   CFIndex i, count = CFDictionaryGetCount(dict); /* count of y<->v pairs */
+  VALUE keys_buf, values_buf; /* owners of the temporary buffers below */
+
+  cfplist_limits_push(limits);
 
   /* Since we are getting these keys from a Property List, they are
    * guaranteed to be CFStrings, and we are safe to allocate this 'array'
@@ -229,8 +754,11 @@ rb_CFDictionary_convert(CFDictionaryRef dict, bool keys2sym)
    * CFStringRefs. If they weren't guaranteed to be CFStrings, we would
    * have
    * to do something else.
+   *
+   * These buffers are allocated with ALLOCV so that ruby will reclaim them if
+   * we raise before we get to free them.
    */
-  CFStringRef *keys = calloc(count, sizeof(CFStringRef));
+  CFStringRef *keys = ALLOCV_N(CFStringRef, keys_buf, count);
 
   /* The only guarantee about the values our CFDictionaryRef contains
    * is that they will be one of the following:
@@ -244,7 +772,7 @@ rb_CFDictionary_convert(CFDictionaryRef dict, bool keys2sym)
    * Since we won't know beforehand, we need to allocate an 'array' of
    * CFTypeRefs to hold them.
    */
-  CFTypeRef *values = calloc(count, sizeof(CFTypeRef));
+  CFTypeRef *values = ALLOCV_N(CFTypeRef, values_buf, count);
 
   /* Get the keys and values from the CFDictionary. Note that ownership
    * follows the "Get Rule", so we will need to copy the values during
@@ -258,14 +786,20 @@ rb_CFDictionary_convert(CFDictionaryRef dict, bool keys2sym)
    * our hash
    */
   for (i = 0; i < count; i++) {
+    cfplist_limits_count_object(limits); /* keys count as objects, too */
     if (keys2sym) { /* convert the CFStringRefs to Symbols */
-      rb_hash_aset(result, CFSTR2SYM(keys[i]), CF2RB(values[i]));
+      rb_hash_aset(result, CFSTR2SYM(keys[i], limits),
+                   CF2RB(values[i], limits));
     } else { /* just use plain strings as the keys */
-      rb_hash_aset(result, CFSTR2RB(keys[i]), CF2RB(values[i]));
+      rb_hash_aset(result, CFSTR2RB(keys[i], limits),
+                   CF2RB(values[i], limits));
     }
   }
 
-  CFRelease(dict); /* matches retain above */
+  ALLOCV_END(keys_buf);
+  ALLOCV_END(values_buf);
+
+  cfplist_limits_pop(limits);
   return result;
 }
 
@@ -288,7 +822,7 @@ rb_CFDate_convert(CFDateRef date)
 }
 
 static VALUE
-corefoundation_to_ruby(CFTypeRef cf_type)
+corefoundation_to_ruby(CFTypeRef cf_type, struct cfplist_limits *limits)
 {
   /*
    *     - CFData       <=>
@@ -302,15 +836,17 @@ corefoundation_to_ruby(CFTypeRef cf_type)
   if (!cf_type)
     return Qnil; /* nil if NULL */
 
+  cfplist_limits_count_object(limits);
+
   CFTypeID tid = CFGetTypeID(cf_type);
   if (tid == CFDataGetTypeID()) {
-    return rb_CFData_convert(cf_type);
+    return rb_CFData_convert(cf_type, limits);
   } else if (tid == CFStringGetTypeID()) {
-    return rb_CFString_convert(cf_type);
+    return rb_CFString_convert(cf_type, limits);
   } else if (tid == CFArrayGetTypeID()) {
-    return rb_CFArray_convert(cf_type);
+    return rb_CFArray_convert(cf_type, limits);
   } else if (tid == CFDictionaryGetTypeID()) {
-    return rb_CFDictionary_convert(cf_type, false);
+    return rb_CFDictionary_convert(cf_type, false, limits);
   } else if (tid == CFDateGetTypeID()) {
     return rb_CFDate_convert(cf_type);
   } else if (tid == CFBooleanGetTypeID()) {
@@ -355,6 +891,18 @@ cf_rsym_convert(VALUE obj)
   return cf_rstring_convert(rb_sym2str(obj));
 }
 
+/**
+ * Convert a ruby Time to a CFDateRef.
+ */
+static CFDateRef
+cf_rtime_convert(VALUE obj)
+{
+  struct timeval tv = rb_time_timeval(obj);
+  CFAbsoluteTime abstime = (double)tv.tv_sec + (double)tv.tv_usec / 1e6 -
+                           kCFAbsoluteTimeIntervalSince1970;
+  return CFDateCreate(kCFAllocatorDefault, abstime);
+}
+
 /**
  * Convert a ruby object to a CFTypeRef.
  *
@@ -366,6 +914,10 @@ cf_rsym_convert(VALUE obj)
 static CFTypeRef
 cf_robject_convert(VALUE obj)
 {
+  if (rb_obj_is_kind_of(obj, rb_cTime)) {
+    return cf_rtime_convert(obj);
+  }
+
   if (rb_respond_to(obj, id_to_s)) {
     return cf_rstring_convert(obj);
   }
@@ -515,13 +1067,16 @@ ruby_to_corefoundation(VALUE obj)
  * Convert a CFPropertyListRef to a ruby object.
  */
 static inline VALUE
-cfplist_to_ruby(CFPropertyListRef plist, Boolean symbolize_keys)
+cfplist_to_ruby(CFPropertyListRef plist, Boolean symbolize_keys,
+                struct cfplist_limits *limits)
 {
   CFTypeID plist_type = CFGetTypeID(plist);
   if (plist_type == CFArrayGetTypeID()) {
-    return rb_CFArray_convert(plist);
+    cfplist_limits_count_object(limits);
+    return rb_CFArray_convert(plist, limits);
   } else if (plist_type == CFDictionaryGetTypeID()) {
-    return rb_CFDictionary_convert(plist, symbolize_keys);
+    cfplist_limits_count_object(limits);
+    return rb_CFDictionary_convert(plist, symbolize_keys, limits);
   }
 
   /* Return nil if it's not an array or hash */
@@ -545,71 +1100,1067 @@ ruby_to_cfplist(VALUE obj)
 }
 
 /*******************************************************************************
- *                              Ruby Method Defs                               *
+ *                             Canonical Encoding                              *
  *******************************************************************************/
 
-/**
- * Raises a CFError, casting to the appropriate ruby type
+/*
+ * CoreFoundation makes no promises about the order it writes dictionary
+ * entries in (the binary writer follows the hash order of the CFDictionary),
+ * so the same ruby object can serialize to different bytes from one run to
+ * the next. When asked for canonical output, we skip CoreFoundation and write
+ * the plist ourselves, straight from the ruby objects:
+ *
+ *   - dictionary keys are sorted by their UTF-8 bytes, and two keys that
+ *     convert to the same string (e.g. :a and "a") are an error
+ *   - integers use the smallest encoding that holds them
+ *   - reals are written with %.17g (XML) or as big-endian doubles (binary),
+ *     with -0.0 written as 0.0 and every NaN written the same way
+ *   - dates are truncated to whole seconds, in UTC
+ *   - binary plists never share objects between references
+ *
+ * The output goes to a cfplist_sink, which either appends to a ruby string or
+ * feeds a digest, so CFPlist.digest never holds the encoded plist in memory.
  */
+
+/* Somewhere to write encoded bytes */
+struct cfplist_sink {
+  void (*write)(struct cfplist_sink *sink, const void *bytes, size_t len);
+  uint64_t pos; /* number of bytes written so far */
+  VALUE str;    /* the output, for string sinks */
+  union {
+    CC_SHA1_CTX sha1;
+    CC_SHA256_CTX sha256;
+    CC_SHA512_CTX sha512;
+  } ctx; /* the digest state, for digest sinks */
+};
+
+static inline void
+cfplist_sink_write(struct cfplist_sink *sink, const void *bytes, size_t len)
+{
+  sink->write(sink, bytes, len);
+  sink->pos += len;
+}
+
+static inline void
+cfplist_sink_puts(struct cfplist_sink *sink, const char *cstr)
+{
+  cfplist_sink_write(sink, cstr, strlen(cstr));
+}
+
 static void
-rb_raise_CFError(CFErrorRef error)
+cfplist_str_write(struct cfplist_sink *sink, const void *bytes, size_t len)
 {
-  CFStringRef domain = CFErrorGetDomain(error);
-  CFIndex code = CFErrorGetCode(error);
+  rb_str_buf_cat(sink->str, bytes, (long)len);
+}
 
-  /* These next two calls use the Copy/Create rule, so we must release the refs
-   * when we are done. */
-  CFStringRef cf_desc = CFErrorCopyDescription(error);
-  CFStringRef cf_reason = CFErrorCopyFailureReason(error);
+/* The CC_*_Update functions take a 32-bit length, so feed them in chunks */
+#define CFPLIST_DIGEST_WRITE(ALGO, UPDATE)                                     \
+  static void cfplist_##ALGO##_write(struct cfplist_sink *sink,                \
+                                     const void *bytes, size_t len)            \
+  {                                                                            \
+    const uint8_t *ptr = bytes;                                                \
+    while (len > 0) {                                                          \
+      CC_LONG chunk = len > UINT32_MAX ? UINT32_MAX : (CC_LONG)len;            \
+      UPDATE(&sink->ctx.ALGO, ptr, chunk);                                     \
+      ptr += chunk;                                                            \
+      len -= chunk;                                                            \
+    }                                                                          \
+  }
 
-  /* It's okay to get pointers for these strings, since we "own" them. */
-  const char *desc = CFStringGetCStringPtr(cf_desc, kCFStringEncodingUTF8);
-  const char *reason = CFStringGetCStringPtr(cf_reason, kCFStringEncodingUTF8);
+CFPLIST_DIGEST_WRITE(sha1, CC_SHA1_Update)
+CFPLIST_DIGEST_WRITE(sha256, CC_SHA256_Update)
+CFPLIST_DIGEST_WRITE(sha512, CC_SHA512_Update)
 
-  if (IS_DOMAIN(domain, kCFErrorDomainPOSIX)) {
-    /* we have a POSIX error. We raise these as Ruby SysErrors */
-    VALUE msg = rb_sprintf("%s %s", desc, reason);
-    /* at this point, we know "code" is an "errno", so we cast to int */
-    VALUE exc = rb_syserr_new_str((int)code, msg);
-    rb_exc_raise(exc);
-  } else if (IS_DOMAIN(domain, kCFErrorDomainOSStatus)) {
-    rb_raise(rb_eCFErrorOSStatus, "%s %s (%ld)", desc, reason, code);
-  } else if (IS_DOMAIN(domain, kCFErrorDomainMach)) {
-    rb_raise(rb_eCFErrorMach, "Mach Error - %s %s (%ld)", desc, reason, code);
-  } else if (IS_DOMAIN(domain, kCFErrorDomainCocoa)) {
-    rb_raise(rb_eCFErrorCocoa, "%s %s (%ld)", desc, reason, code);
+/**
+ * Converts a Symbol or a String (or anything with `to_str`) to a UTF-8
+ * string. Like cf_rstring_convert(), this raises a TypeError for anything
+ * else, so `nil` can't end up encoded the same as "".
+ */
+static VALUE
+canonical_string(VALUE obj)
+{
+  if (SYMBOL_P(obj)) {
+    obj = rb_sym2str(obj);
   } else {
-    /* This is probably unreachable */
-    rb_raise(rb_eCFError, "%s %s (%ld)", desc, reason, code);
+    StringValue(obj);
+  }
+
+  /* this raises if the string can't be represented in UTF-8 */
+  obj = rb_str_encode(obj, rb_enc_from_encoding(rb_utf8_encoding()), 0, Qnil);
+  if (rb_enc_str_coderange(obj) == ENC_CODERANGE_BROKEN) {
+    rb_raise(rb_eEncodingError, "invalid byte sequence in plist string");
   }
+
+  return obj;
 }
 
 /**
- * Parses a string representation of a PList to a ruby hash.
- *
- * TODO: Add more complex options
+ * Returns the keys of `hash` converted to strings and sorted, and sets
+ * `*lookup` to a hash from each converted key to its value.
  */
 static VALUE
-plist_parse(int argc, VALUE *argv, VALUE self)
+canonical_sorted_keys(VALUE hash, VALUE *lookup)
 {
-  VALUE plist_str, v_symbolize_keys;
-  Boolean symbolize_keys;
+  VALUE keys = rb_funcall(hash, id_keys, 0);
+  VALUE vals = rb_funcall(hash, id_vals, 0);
+  long i, count = RARRAY_LEN(keys);
+  VALUE result = rb_ary_new_capa(count);
 
-  if (1 == rb_scan_args(argc, argv, "11", &plist_str, &v_symbolize_keys)) {
-    v_symbolize_keys = Qfalse;
-  }
+  *lookup = rb_hash_new();
 
-  if (NIL_P(v_symbolize_keys) || v_symbolize_keys == Qfalse) {
-    symbolize_keys = false;
-  } else {
-    symbolize_keys = true;
-  }
+  for (i = 0; i < count; i++) {
+    VALUE key = canonical_string(rb_ary_entry(keys, i));
 
-  StringValue(plist_str);
+    if (rb_hash_lookup2(*lookup, key, Qundef) != Qundef) {
+      rb_raise(rb_eArgError, "duplicate plist key: %" PRIsVALUE, key);
+    }
 
-  /* allocate a buffer to hold the string data */
-  const uint8_t *strdata = (const uint8_t *)StringValuePtr(plist_str);
-  CFIndex strlen = RSTRING_LEN(plist_str);
+    rb_hash_aset(*lookup, key, rb_ary_entry(vals, i));
+    rb_ary_push(result, key);
+  }
+
+  /* these are all UTF-8 strings, so this compares their bytes */
+  return rb_ary_sort_bang(result);
+}
+
+/* Normalizes -0.0 to 0.0, and every NaN to the same NaN. */
+static inline double
+canonical_double(double val)
+{
+  if (isnan(val))
+    return NAN;
+  if (val == 0.0)
+    return 0.0;
+  return val;
+}
+
+/* Returns a Time as whole seconds since the epoch, rounding down. */
+static inline time_t
+canonical_time(VALUE obj)
+{
+  struct timeval tv = rb_time_timeval(obj); /* tv_usec is never negative */
+  return tv.tv_sec;
+}
+
+static void
+canonical_xml_indent(struct cfplist_sink *sink, long depth)
+{
+  while (depth-- > 0)
+    cfplist_sink_write(sink, "\t", 1);
+}
+
+/* Writes `<tag>str</tag>`, escaping the contents of the string. */
+static void
+canonical_xml_string(struct cfplist_sink *sink, const char *tag, VALUE str)
+{
+  const char *ptr = RSTRING_PTR(str), *run = ptr;
+  const char *end = ptr + RSTRING_LEN(str);
+
+  cfplist_sink_puts(sink, "<");
+  cfplist_sink_puts(sink, tag);
+  cfplist_sink_puts(sink, ">");
+
+  for (; ptr < end; ptr++) {
+    const char *escaped;
+
+    switch (*ptr) {
+    case '&':
+      escaped = "&amp;";
+      break;
+    case '<':
+      escaped = "&lt;";
+      break;
+    case '>':
+      escaped = "&gt;";
+      break;
+    default:
+      continue;
+    }
+
+    cfplist_sink_write(sink, run, ptr - run);
+    cfplist_sink_puts(sink, escaped);
+    run = ptr + 1;
+  }
+  cfplist_sink_write(sink, run, end - run);
+
+  cfplist_sink_puts(sink, "</");
+  cfplist_sink_puts(sink, tag);
+  cfplist_sink_puts(sink, ">\n");
+}
+
+static void
+canonical_xml_value(struct cfplist_sink *sink, VALUE obj, long depth)
+{
+  char buf[64];
+  long i, count;
+
+  canonical_xml_indent(sink, depth);
+
+  switch (TYPE(obj)) {
+  case T_ARRAY:
+    count = RARRAY_LEN(obj);
+    if (count == 0) {
+      cfplist_sink_puts(sink, "<array/>\n");
+      return;
+    }
+
+    cfplist_sink_puts(sink, "<array>\n");
+    for (i = 0; i < count; i++)
+      canonical_xml_value(sink, rb_ary_entry(obj, i), depth + 1);
+    canonical_xml_indent(sink, depth);
+    cfplist_sink_puts(sink, "</array>\n");
+    return;
+
+  case T_HASH: {
+    VALUE lookup, keys = canonical_sorted_keys(obj, &lookup);
+    count = RARRAY_LEN(keys);
+    if (count == 0) {
+      cfplist_sink_puts(sink, "<dict/>\n");
+      return;
+    }
+
+    cfplist_sink_puts(sink, "<dict>\n");
+    for (i = 0; i < count; i++) {
+      VALUE key = rb_ary_entry(keys, i);
+      canonical_xml_indent(sink, depth + 1);
+      canonical_xml_string(sink, "key", key);
+      canonical_xml_value(sink, rb_hash_aref(lookup, key), depth + 1);
+    }
+    canonical_xml_indent(sink, depth);
+    cfplist_sink_puts(sink, "</dict>\n");
+    return;
+  }
+
+  case T_TRUE:
+    cfplist_sink_puts(sink, "<true/>\n");
+    return;
+
+  case T_FALSE:
+    cfplist_sink_puts(sink, "<false/>\n");
+    return;
+
+  case T_FIXNUM:
+  case T_BIGNUM:
+    snprintf(buf, sizeof(buf), "<integer>%lld</integer>\n", NUM2LL(obj));
+    cfplist_sink_puts(sink, buf);
+    return;
+
+  case T_FLOAT: {
+    double val = canonical_double(NUM2DBL(obj));
+    if (isnan(val)) {
+      cfplist_sink_puts(sink, "<real>nan</real>\n");
+    } else if (isinf(val)) {
+      cfplist_sink_puts(sink, val > 0 ? "<real>+infinity</real>\n"
+                                      : "<real>-infinity</real>\n");
+    } else {
+      /* ruby's own printf always writes a '.', whatever LC_NUMERIC says, and
+       * CoreFoundation can't read anything else */
+      ruby_snprintf(buf, sizeof(buf), "<real>%.17g</real>\n", val);
+      cfplist_sink_puts(sink, buf);
+    }
+    return;
+  }
+
+  default:
+    break;
+  }
+
+  if (rb_obj_is_kind_of(obj, rb_cTime)) {
+    time_t secs = canonical_time(obj);
+    struct tm tm;
+    gmtime_r(&secs, &tm);
+    strftime(buf, sizeof(buf), "<date>%Y-%m-%dT%H:%M:%SZ</date>\n", &tm);
+    cfplist_sink_puts(sink, buf);
+    return;
+  }
+
+  canonical_xml_string(sink, "string", canonical_string(obj));
+}
+
+static void
+canonical_xml_write(struct cfplist_sink *sink, VALUE obj)
+{
+  cfplist_sink_puts(sink,
+                    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                    "<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" "
+                    "\"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n"
+                    "<plist version=\"1.0\">\n");
+  canonical_xml_value(sink, obj, 0);
+  cfplist_sink_puts(sink, "</plist>\n");
+}
+
+/*
+ * Objects are written children-first, so that a collection knows the indices
+ * of its children by the time we write it, and the top object is written
+ * last. The only thing we need before we start is the number of objects,
+ * which decides how wide each object ref is.
+ */
+struct canonical_bplist {
+  struct cfplist_sink *sink;
+  uint64_t num_objects; /* how many objects we expect to write */
+  uint64_t count;       /* how many objects we have written */
+  uint64_t *offsets;    /* offset of each object written so far */
+  uint8_t ref_size;     /* width of an object ref, in bytes */
+};
+
+/* Number of bytes needed to hold `val`: 1, 2, 4 or 8. */
+static inline uint8_t
+bplist_uint_size(uint64_t val)
+{
+  if (val <= UINT8_MAX)
+    return 1;
+  if (val <= UINT16_MAX)
+    return 2;
+  if (val <= UINT32_MAX)
+    return 4;
+  return 8;
+}
+
+/* Write `val` as a big-endian unsigned integer of `nbytes` bytes. */
+static void
+bplist_write_uint(struct cfplist_sink *sink, uint64_t val, uint8_t nbytes)
+{
+  uint8_t buf[8];
+  uint8_t i;
+
+  for (i = nbytes; i-- > 0; val >>= 8)
+    buf[i] = val & 0xFF;
+
+  cfplist_sink_write(sink, buf, nbytes);
+}
+
+/* Write an int object. Negative numbers are always 8 bytes. */
+static void
+bplist_write_int(struct cfplist_sink *sink, int64_t val)
+{
+  uint8_t nbytes = val < 0 ? 8 : bplist_uint_size((uint64_t)val);
+  uint8_t marker = 0x10;
+
+  /* the low nibble is log2 of the number of bytes that follow */
+  while ((1 << (marker & 0x0F)) < nbytes)
+    marker++;
+
+  cfplist_sink_write(sink, &marker, 1);
+  bplist_write_uint(sink, (uint64_t)val, nbytes);
+}
+
+/* Write a marker byte of type `type` for an object with `count` elements. */
+static void
+bplist_write_header(struct cfplist_sink *sink, uint8_t type, uint64_t count)
+{
+  uint8_t marker = (type << 4) | (count < 0x0F ? count : 0x0F);
+
+  cfplist_sink_write(sink, &marker, 1);
+  if (count >= 0x0F)
+    bplist_write_int(sink, (int64_t)count);
+}
+
+/* Write a double (a real, or a date) as a big-endian float64. */
+static void
+bplist_write_double(struct cfplist_sink *sink, uint8_t marker, double val)
+{
+  uint64_t bits;
+
+  memcpy(&bits, &val, sizeof(bits));
+  cfplist_sink_write(sink, &marker, 1);
+  bplist_write_uint(sink, bits, 8);
+}
+
+/* Counts the objects in `obj`, as canonical_bplist_value() will write them. */
+static uint64_t
+canonical_bplist_count(VALUE obj)
+{
+  uint64_t result = 1;
+  long i;
+
+  switch (TYPE(obj)) {
+  case T_ARRAY:
+    for (i = 0; i < RARRAY_LEN(obj); i++)
+      result += canonical_bplist_count(rb_ary_entry(obj, i));
+    break;
+
+  case T_HASH: {
+    VALUE vals = rb_funcall(obj, id_vals, 0);
+    result += RARRAY_LEN(vals); /* one for each key */
+    for (i = 0; i < RARRAY_LEN(vals); i++)
+      result += canonical_bplist_count(rb_ary_entry(vals, i));
+    break;
+  }
+
+  default:
+    break;
+  }
+
+  return result;
+}
+
+/* Record the offset of the object we're about to write, and return its
+ * index. */
+static uint64_t
+canonical_bplist_begin(struct canonical_bplist *bp)
+{
+  /* this can only happen if to_s or similar changed the object under us */
+  if (bp->count == bp->num_objects)
+    rb_raise(rb_eRuntimeError, "object modified while generating plist");
+
+  bp->offsets[bp->count] = bp->sink->pos;
+  return bp->count++;
+}
+
+static uint64_t
+canonical_bplist_string(struct canonical_bplist *bp, VALUE str)
+{
+  uint64_t index = canonical_bplist_begin(bp);
+
+  if (rb_enc_str_asciionly_p(str)) {
+    bplist_write_header(bp->sink, 0x5, RSTRING_LEN(str));
+  } else {
+    str = rb_str_encode(str, rb_enc_from_encoding(enc_utf16be), 0, Qnil);
+    bplist_write_header(bp->sink, 0x6, RSTRING_LEN(str) / 2);
+  }
+  cfplist_sink_write(bp->sink, RSTRING_PTR(str), RSTRING_LEN(str));
+
+  return index;
+}
+
+/* Write the object refs for a collection. */
+static void
+canonical_bplist_refs(struct canonical_bplist *bp, const uint64_t *refs,
+                      long count)
+{
+  long i;
+  for (i = 0; i < count; i++)
+    bplist_write_uint(bp->sink, refs[i], bp->ref_size);
+}
+
+/* Write `obj` and everything in it, returning the index of `obj`. */
+static uint64_t
+canonical_bplist_value(struct canonical_bplist *bp, VALUE obj)
+{
+  struct cfplist_sink *sink = bp->sink;
+  uint64_t index, *refs;
+  VALUE refs_buf;
+  long i, count;
+
+  switch (TYPE(obj)) {
+  case T_ARRAY:
+    count = RARRAY_LEN(obj);
+    refs = ALLOCV_N(uint64_t, refs_buf, count);
+    for (i = 0; i < count; i++)
+      refs[i] = canonical_bplist_value(bp, rb_ary_entry(obj, i));
+
+    index = canonical_bplist_begin(bp);
+    bplist_write_header(sink, 0xA, count);
+    canonical_bplist_refs(bp, refs, count);
+    ALLOCV_END(refs_buf);
+    return index;
+
+  case T_HASH: {
+    VALUE lookup, keys = canonical_sorted_keys(obj, &lookup);
+    count = RARRAY_LEN(keys);
+
+    /* all of the key refs, followed by all of the value refs */
+    refs = ALLOCV_N(uint64_t, refs_buf, 2 * count);
+    for (i = 0; i < count; i++)
+      refs[i] = canonical_bplist_string(bp, rb_ary_entry(keys, i));
+    for (i = 0; i < count; i++) {
+      VALUE val = rb_hash_aref(lookup, rb_ary_entry(keys, i));
+      refs[count + i] = canonical_bplist_value(bp, val);
+    }
+
+    index = canonical_bplist_begin(bp);
+    bplist_write_header(sink, 0xD, count);
+    canonical_bplist_refs(bp, refs, 2 * count);
+    ALLOCV_END(refs_buf);
+    return index;
+  }
+
+  case T_TRUE:
+  case T_FALSE: {
+    uint8_t marker = (obj == Qtrue) ? 0x09 : 0x08;
+    index = canonical_bplist_begin(bp);
+    cfplist_sink_write(sink, &marker, 1);
+    return index;
+  }
+
+  case T_FIXNUM:
+  case T_BIGNUM: {
+    int64_t val = NUM2LL(obj);
+    index = canonical_bplist_begin(bp);
+    bplist_write_int(sink, val);
+    return index;
+  }
+
+  case T_FLOAT: {
+    double val = canonical_double(NUM2DBL(obj));
+    index = canonical_bplist_begin(bp);
+    bplist_write_double(sink, 0x23, val);
+    return index;
+  }
+
+  default:
+    break;
+  }
+
+  if (rb_obj_is_kind_of(obj, rb_cTime)) {
+    double abstime =
+        (double)canonical_time(obj) - kCFAbsoluteTimeIntervalSince1970;
+    index = canonical_bplist_begin(bp);
+    bplist_write_double(sink, 0x33, abstime);
+    return index;
+  }
+
+  return canonical_bplist_string(bp, canonical_string(obj));
+}
+
+static void
+canonical_bplist_write(struct cfplist_sink *sink, VALUE obj)
+{
+  struct canonical_bplist bp;
+  VALUE offsets_buf;
+  uint64_t i, top, table;
+  uint8_t offset_size;
+  static const uint8_t unused[6] = {0};
+
+  bp.sink = sink;
+  bp.num_objects = canonical_bplist_count(obj);
+  bp.count = 0;
+  bp.offsets = ALLOCV_N(uint64_t, offsets_buf, bp.num_objects);
+  /* CF requires refs to hold the object count itself, not just the largest
+   * index, so 256 objects need 2-byte refs */
+  bp.ref_size = bplist_uint_size(bp.num_objects);
+
+  cfplist_sink_write(sink, BPLIST_HEADER, BPLIST_HEADER_LEN);
+  top = canonical_bplist_value(&bp, obj);
+
+  if (bp.count != bp.num_objects)
+    rb_raise(rb_eRuntimeError, "object modified while generating plist");
+
+  /* the offset ints have to be wide enough for the offset of the table
+   * itself, which comes after every object */
+  table = sink->pos;
+  offset_size = bplist_uint_size(table);
+  for (i = 0; i < bp.count; i++)
+    bplist_write_uint(sink, bp.offsets[i], offset_size);
+
+  cfplist_sink_write(sink, unused, sizeof(unused));
+  cfplist_sink_write(sink, &offset_size, 1);
+  cfplist_sink_write(sink, &bp.ref_size, 1);
+  bplist_write_uint(sink, bp.num_objects, 8);
+  bplist_write_uint(sink, top, 8);
+  bplist_write_uint(sink, table, 8);
+
+  ALLOCV_END(offsets_buf);
+}
+
+/**
+ * Writes the canonical encoding of `obj` to `sink`.
+ */
+static void
+canonical_write(struct cfplist_sink *sink, VALUE obj,
+                CFPropertyListFormat format)
+{
+  if (!RB_TYPE_P(obj, T_ARRAY) && !RB_TYPE_P(obj, T_HASH)) {
+    rb_raise(rb_eTypeError, "plist root must be an Array or a Hash, not %s",
+             rb_obj_classname(obj));
+  }
+
+  if (format == kCFPropertyListBinaryFormat_v1_0) {
+    canonical_bplist_write(sink, obj);
+  } else {
+    canonical_xml_write(sink, obj);
+  }
+}
+
+/*******************************************************************************
+ *                               Structural Diff                               *
+ *******************************************************************************/
+
+/*
+ * To compare two plists, we give every array and dictionary a digest of its
+ * whole subtree (a Merkle tree, in other words), and only descend into pairs
+ * of collections whose digests differ. Each collection's digest is computed
+ * once and remembered, so the total cost is one pass over each plist, plus
+ * work proportional to the parts that actually changed.
+ *
+ * Digests are SHA-256, and include a tag for each type, so that e.g. the
+ * string "1", the integer 1 and the real 1.0 are all different. Dictionary
+ * digests hash their entries in key order, so they don't depend on the order
+ * CoreFoundation stores the entries in.
+ *
+ * Before diffing, we digest each whole plist once while counting it against
+ * the resource limits. That is the only place the limits are checked for XML
+ * input, since bplist_scan() only understands the binary format.
+ */
+
+#define DIFF_DIGEST_LEN CC_SHA256_DIGEST_LENGTH
+
+struct plist_diff {
+  VALUE old_str; /* the serialized plists */
+  VALUE new_str;
+  CFPropertyListRef old_plist;
+  CFPropertyListRef new_plist;
+  CFMutableDictionaryRef memo; /* collection => offset of digest in `store` */
+  CFMutableDataRef store;      /* digests of the collections seen so far */
+  VALUE changes;               /* the result */
+  VALUE path;                  /* path from the root to the current pair */
+  struct cfplist_limits *limits;
+  struct cfplist_limits *digest_limits; /* checked by diff_digest(), or NULL */
+};
+
+static void
+diff_digest(struct plist_diff *diff, CFTypeRef obj, uint8_t *md);
+
+/* Hash a type tag followed by `len` bytes. */
+static void
+diff_digest_bytes(uint8_t tag, const void *bytes, size_t len, uint8_t *md)
+{
+  CC_SHA256_CTX ctx;
+  CC_SHA256_Init(&ctx);
+  CC_SHA256_Update(&ctx, &tag, 1);
+
+  const uint8_t *ptr = bytes;
+  while (len > 0) {
+    CC_LONG chunk = len > UINT32_MAX ? UINT32_MAX : (CC_LONG)len;
+    CC_SHA256_Update(&ctx, ptr, chunk);
+    ptr += chunk;
+    len -= chunk;
+  }
+
+  CC_SHA256_Final(md, &ctx);
+}
+
+static void
+diff_digest_string(struct plist_diff *diff, CFStringRef str, uint8_t *md)
+{
+  CFIndex len = CFStringGetLength(str), nbytes = 0;
+  CFRange rng = CFRangeMake(0, len);
+  VALUE buf;
+
+  /* Binary plists can have NULs inside strings, so we can't use strlen() on
+   * the C string, even when there is one */
+  CFIndex converted = CFStringGetBytes(str, rng, kCFStringEncodingUTF8, 0,
+                                       false, NULL, 0, &nbytes);
+
+  if (converted != len) {
+    /* Conversion stops at anything that isn't valid UTF-16, like an unpaired
+     * surrogate, so hash the UTF-16 code units themselves rather than just the
+     * part before it. These get their own tag, since they aren't UTF-8. */
+    cfplist_limits_count_bytes(diff->digest_limits, len * sizeof(UniChar));
+    UniChar *chars = ALLOCV_N(UniChar, buf, len);
+    CFStringGetCharacters(str, rng, chars);
+
+    diff_digest_bytes('u', chars, len * sizeof(UniChar), md);
+    ALLOCV_END(buf);
+    return;
+  }
+
+  cfplist_limits_count_bytes(diff->digest_limits, nbytes);
+
+  const char *cstr = CFStringGetCStringPtr(str, kCFStringEncodingUTF8);
+  if (cstr != NULL) {
+    diff_digest_bytes('s', cstr, nbytes, md);
+    return;
+  }
+
+  /* No fast path, so copy the string out as UTF-8 */
+  UInt8 *bytes = ALLOCV_N(UInt8, buf, nbytes);
+  converted = CFStringGetBytes(str, rng, kCFStringEncodingUTF8, 0, false,
+                               bytes, nbytes, NULL);
+  if (converted != len) {
+    /* we just measured it, so this shouldn't happen */
+    rb_raise(rb_eRuntimeError, "Unable to convert string to UTF8");
+  }
+
+  diff_digest_bytes('s', bytes, nbytes, md);
+  ALLOCV_END(buf);
+}
+
+static void
+diff_digest_number(CFNumberRef number, uint8_t *md)
+{
+  if (CFNumberIsFloatType(number)) {
+    double dval = 0;
+    CFNumberGetValue(number, kCFNumberDoubleType, &dval);
+    dval = canonical_double(dval);
+    diff_digest_bytes('r', &dval, sizeof(dval), md);
+    return;
+  }
+
+  long long llval = 0;
+  if (CFNumberGetValue(number, kCFNumberLongLongType, &llval)) {
+    diff_digest_bytes('i', &llval, sizeof(llval), md);
+    return;
+  }
+
+  /* Too big for a long long, which would have clamped it, so every integer
+   * above LLONG_MAX would hash the same. */
+  struct cfplist_sint128 wide = {0, 0};
+  if (!CFNumberGetValue(number, CFPLIST_NUMBER_SINT128_TYPE, &wide))
+    rb_raise(rb_eCFErrorFormat, "unsupported integer in plist");
+  diff_digest_bytes('I', &wide, sizeof(wide), md);
+}
+
+static void
+diff_digest_array(struct plist_diff *diff, CFArrayRef array, uint8_t *md)
+{
+  CFIndex i, count = CFArrayGetCount(array);
+  uint8_t child[DIFF_DIGEST_LEN];
+  CC_SHA256_CTX ctx;
+
+  CC_SHA256_Init(&ctx);
+  CC_SHA256_Update(&ctx, "a", 1);
+  CC_SHA256_Update(&ctx, &count, sizeof(count));
+
+  for (i = 0; i < count; i++) {
+    diff_digest(diff, CFArrayGetValueAtIndex(array, i), child);
+    CC_SHA256_Update(&ctx, child, DIFF_DIGEST_LEN);
+  }
+
+  CC_SHA256_Final(md, &ctx);
+}
+
+/* qsort comparator for an array of CFStringRefs */
+static int
+diff_compare_keys(const void *a, const void *b)
+{
+  return (int)CFStringCompare(*(CFStringRef *)a, *(CFStringRef *)b, 0);
+}
+
+static void
+diff_digest_dict(struct plist_diff *diff, CFDictionaryRef dict, uint8_t *md)
+{
+  CFIndex i, count = CFDictionaryGetCount(dict);
+  uint8_t child[DIFF_DIGEST_LEN];
+  VALUE keys_buf;
+  CC_SHA256_CTX ctx;
+
+  CFStringRef *keys = ALLOCV_N(CFStringRef, keys_buf, count);
+  CFDictionaryGetKeysAndValues(dict, (const void **)keys, NULL);
+  qsort(keys, count, sizeof(CFStringRef), diff_compare_keys);
+
+  CC_SHA256_Init(&ctx);
+  CC_SHA256_Update(&ctx, "d", 1);
+  CC_SHA256_Update(&ctx, &count, sizeof(count));
+
+  for (i = 0; i < count; i++) {
+    diff_digest(diff, keys[i], child);
+    CC_SHA256_Update(&ctx, child, DIFF_DIGEST_LEN);
+    diff_digest(diff, CFDictionaryGetValue(dict, keys[i]), child);
+    CC_SHA256_Update(&ctx, child, DIFF_DIGEST_LEN);
+  }
+
+  ALLOCV_END(keys_buf);
+  CC_SHA256_Final(md, &ctx);
+}
+
+/*
+ * Compute the digest of `obj` into `md`. Digests of arrays and dictionaries
+ * are remembered, so we never hash the same subtree twice.
+ */
+static void
+diff_digest(struct plist_diff *diff, CFTypeRef obj, uint8_t *md)
+{
+  CFTypeID tid = CFGetTypeID(obj);
+  const void *offset;
+
+  cfplist_limits_count_object(diff->digest_limits);
+
+  if (tid == CFStringGetTypeID()) {
+    diff_digest_string(diff, obj, md);
+    return;
+  } else if (tid == CFNumberGetTypeID()) {
+    diff_digest_number(obj, md);
+    return;
+  } else if (tid == CFBooleanGetTypeID()) {
+    uint8_t val = CFBooleanGetValue(obj);
+    diff_digest_bytes('b', &val, 1, md);
+    return;
+  } else if (tid == CFDateGetTypeID()) {
+    CFAbsoluteTime abstime = CFDateGetAbsoluteTime(obj);
+    diff_digest_bytes('t', &abstime, sizeof(abstime), md);
+    return;
+  } else if (tid == CFDataGetTypeID()) {
+    cfplist_limits_count_bytes(diff->digest_limits, CFDataGetLength(obj));
+    diff_digest_bytes('D', CFDataGetBytePtr(obj), CFDataGetLength(obj), md);
+    return;
+  }
+
+  if (CFDictionaryGetValueIfPresent(diff->memo, obj, &offset)) {
+    memcpy(md, CFDataGetBytePtr(diff->store) + (uintptr_t)offset,
+           DIFF_DIGEST_LEN);
+    return;
+  }
+
+  cfplist_limits_push(diff->digest_limits);
+  if (tid == CFArrayGetTypeID()) {
+    diff_digest_array(diff, obj, md);
+  } else if (tid == CFDictionaryGetTypeID()) {
+    diff_digest_dict(diff, obj, md);
+  } else {
+    diff_digest_bytes('?', NULL, 0, md); /* not a plist type */
+  }
+  cfplist_limits_pop(diff->digest_limits);
+
+  offset = (const void *)(uintptr_t)CFDataGetLength(diff->store);
+  CFDataAppendBytes(diff->store, md, DIFF_DIGEST_LEN);
+  CFDictionarySetValue(diff->memo, obj, offset);
+}
+
+/* Record a change at the current path. `old_val` or `new_val` may be NULL. */
+static void
+diff_record(struct plist_diff *diff, ID type, CFTypeRef old_val,
+            CFTypeRef new_val)
+{
+  VALUE change = rb_ary_new_capa(4);
+
+  rb_ary_push(change, ID2SYM(type));
+  rb_ary_push(change, rb_ary_dup(diff->path));
+  if (old_val != NULL)
+    rb_ary_push(change, CF2RB(old_val, diff->limits));
+  if (new_val != NULL)
+    rb_ary_push(change, CF2RB(new_val, diff->limits));
+
+  rb_ary_push(diff->changes, change);
+}
+
+static void
+diff_values(struct plist_diff *diff, CFTypeRef old_val, CFTypeRef new_val);
+
+/*
+ * Dictionaries are compared key by key. We walk both sets of keys in sorted
+ * order, so that the changes come out in a predictable order.
+ */
+static void
+diff_dicts(struct plist_diff *diff, CFDictionaryRef old_dict,
+           CFDictionaryRef new_dict)
+{
+  CFIndex old_count = CFDictionaryGetCount(old_dict);
+  CFIndex new_count = CFDictionaryGetCount(new_dict);
+  CFIndex i = 0, j = 0;
+  VALUE old_buf, new_buf;
+
+  CFStringRef *old_keys = ALLOCV_N(CFStringRef, old_buf, old_count);
+  CFStringRef *new_keys = ALLOCV_N(CFStringRef, new_buf, new_count);
+  CFDictionaryGetKeysAndValues(old_dict, (const void **)old_keys, NULL);
+  CFDictionaryGetKeysAndValues(new_dict, (const void **)new_keys, NULL);
+  qsort(old_keys, old_count, sizeof(CFStringRef), diff_compare_keys);
+  qsort(new_keys, new_count, sizeof(CFStringRef), diff_compare_keys);
+
+  while (i < old_count || j < new_count) {
+    CFComparisonResult cmp;
+    CFStringRef key;
+
+    if (i == old_count) {
+      cmp = kCFCompareGreaterThan;
+    } else if (j == new_count) {
+      cmp = kCFCompareLessThan;
+    } else {
+      cmp = CFStringCompare(old_keys[i], new_keys[j], 0);
+    }
+
+    key = (cmp == kCFCompareGreaterThan) ? new_keys[j] : old_keys[i];
+    rb_ary_push(diff->path, CFSTR2RB(key, NULL));
+
+    if (cmp == kCFCompareLessThan) { /* only in the old dict */
+      diff_record(diff, id_removed,
+                  CFDictionaryGetValue(old_dict, key), NULL);
+      i++;
+    } else if (cmp == kCFCompareGreaterThan) { /* only in the new dict */
+      diff_record(diff, id_added, NULL,
+                  CFDictionaryGetValue(new_dict, key));
+      j++;
+    } else { /* in both */
+      diff_values(diff, CFDictionaryGetValue(old_dict, key),
+                  CFDictionaryGetValue(new_dict, key));
+      i++;
+      j++;
+    }
+
+    rb_ary_pop(diff->path);
+  }
+
+  ALLOCV_END(old_buf);
+  ALLOCV_END(new_buf);
+}
+
+/*
+ * Arrays are compared index by index, so an insertion shows up as a change to
+ * every element after it, followed by an addition at the end.
+ */
+static void
+diff_arrays(struct plist_diff *diff, CFArrayRef old_array,
+            CFArrayRef new_array)
+{
+  CFIndex old_count = CFArrayGetCount(old_array);
+  CFIndex new_count = CFArrayGetCount(new_array);
+  CFIndex i, count = old_count > new_count ? old_count : new_count;
+
+  for (i = 0; i < count; i++) {
+    rb_ary_push(diff->path, LONG2NUM(i));
+
+    if (i >= new_count) {
+      diff_record(diff, id_removed,
+                  CFArrayGetValueAtIndex(old_array, i), NULL);
+    } else if (i >= old_count) {
+      diff_record(diff, id_added, NULL,
+                  CFArrayGetValueAtIndex(new_array, i));
+    } else {
+      diff_values(diff, CFArrayGetValueAtIndex(old_array, i),
+                  CFArrayGetValueAtIndex(new_array, i));
+    }
+
+    rb_ary_pop(diff->path);
+  }
+}
+
+/* Compare two values found at the same path. */
+static void
+diff_values(struct plist_diff *diff, CFTypeRef old_val, CFTypeRef new_val)
+{
+  CFTypeID tid = CFGetTypeID(old_val);
+  uint8_t old_md[DIFF_DIGEST_LEN], new_md[DIFF_DIGEST_LEN];
+
+  if (old_val == new_val)
+    return; /* CoreFoundation shares some objects */
+
+  if (tid == CFGetTypeID(new_val)) {
+    if (tid == CFArrayGetTypeID() || tid == CFDictionaryGetTypeID()) {
+      diff_digest(diff, old_val, old_md);
+      diff_digest(diff, new_val, new_md);
+      if (memcmp(old_md, new_md, DIFF_DIGEST_LEN) == 0)
+        return; /* the whole subtree is the same */
+
+      if (tid == CFArrayGetTypeID()) {
+        diff_arrays(diff, old_val, new_val);
+      } else {
+        diff_dicts(diff, old_val, new_val);
+      }
+      return;
+    }
+
+    /* CFEqual considers 1 and 1.0 equal, but we don't */
+    if (CFEqual(old_val, new_val) &&
+        (tid != CFNumberGetTypeID() ||
+         CFNumberIsFloatType(old_val) == CFNumberIsFloatType(new_val)))
+      return;
+  }
+
+  diff_record(diff, id_changed, old_val, new_val);
+}
+
+/* Digest all of `plist`, checking it against the limits on its own. */
+static void
+diff_check_limits(struct plist_diff *diff, CFPropertyListRef plist)
+{
+  uint8_t md[DIFF_DIGEST_LEN];
+
+  cfplist_limits_reset(diff->limits);
+  diff->digest_limits = diff->limits;
+  diff_digest(diff, plist, md);
+  diff->digest_limits = NULL;
+}
+
+/* The body of plist_diff(), run under rb_ensure. */
+static VALUE
+diff_run(VALUE arg)
+{
+  struct plist_diff *diff = (struct plist_diff *)arg;
+
+  diff->old_plist = plist_create(diff->old_str, diff->limits);
+  diff->new_plist = plist_create(diff->new_str, diff->limits);
+
+  /* keys are compared by pointer, and neither keys nor values are retained */
+  diff->memo = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, NULL, NULL);
+  diff->store = CFDataCreateMutable(kCFAllocatorDefault, 0);
+
+  /* this also fills in the memo, so diff_values() won't hash anything again */
+  diff_check_limits(diff, diff->old_plist);
+  diff_check_limits(diff, diff->new_plist);
+
+  /* the values we put in the result are counted separately */
+  cfplist_limits_reset(diff->limits);
+  diff_values(diff, diff->old_plist, diff->new_plist);
+  return diff->changes;
+}
+
+/* Releases the references held by plist_diff(). */
+static VALUE
+diff_release(VALUE arg)
+{
+  struct plist_diff *diff = (struct plist_diff *)arg;
+
+  if (diff->old_plist != NULL)
+    CFRelease(diff->old_plist);
+  if (diff->new_plist != NULL)
+    CFRelease(diff->new_plist);
+  if (diff->memo != NULL)
+    CFRelease(diff->memo);
+  if (diff->store != NULL)
+    CFRelease(diff->store);
+
+  return Qnil;
+}
+
+/*******************************************************************************
+ *                              Ruby Method Defs                               *
+ *******************************************************************************/
+
+/**
+ * Raises a CFError, casting to the appropriate ruby type
+ */
+static void
+rb_raise_CFError(CFErrorRef error)
+{
+  CFStringRef domain = CFErrorGetDomain(error);
+  CFIndex code = CFErrorGetCode(error);
+
+  /* These next two calls use the Copy/Create rule, so we must release the refs
+   * when we are done. */
+  CFStringRef cf_desc = CFErrorCopyDescription(error);
+  CFStringRef cf_reason = CFErrorCopyFailureReason(error);
+
+  /* It's okay to get pointers for these strings, since we "own" them. */
+  const char *desc = CFStringGetCStringPtr(cf_desc, kCFStringEncodingUTF8);
+  const char *reason = CFStringGetCStringPtr(cf_reason, kCFStringEncodingUTF8);
+
+  if (IS_DOMAIN(domain, kCFErrorDomainPOSIX)) {
+    /* we have a POSIX error. We raise these as Ruby SysErrors */
+    VALUE msg = rb_sprintf("%s %s", desc, reason);
+    /* at this point, we know "code" is an "errno", so we cast to int */
+    VALUE exc = rb_syserr_new_str((int)code, msg);
+    rb_exc_raise(exc);
+  } else if (IS_DOMAIN(domain, kCFErrorDomainOSStatus)) {
+    rb_raise(rb_eCFErrorOSStatus, "%s %s (%ld)", desc, reason, code);
+  } else if (IS_DOMAIN(domain, kCFErrorDomainMach)) {
+    rb_raise(rb_eCFErrorMach, "Mach Error - %s %s (%ld)", desc, reason, code);
+  } else if (IS_DOMAIN(domain, kCFErrorDomainCocoa)) {
+    rb_raise(rb_eCFErrorCocoa, "%s %s (%ld)", desc, reason, code);
+  } else {
+    /* This is probably unreachable */
+    rb_raise(rb_eCFError, "%s %s (%ld)", desc, reason, code);
+  }
+}
+
+/**
+ * Creates a CFPropertyList from the serialized plist in the ruby string
+ * `plist_str`, after checking it against `limits`. Raises if the plist can't
+ * be parsed. The caller owns (and must release) the result.
+ */
+static CFPropertyListRef
+plist_create(VALUE plist_str, const struct cfplist_limits *limits)
+{
+  StringValue(plist_str);
+
+  /* allocate a buffer to hold the string data */
+  const uint8_t *strdata = (const uint8_t *)StringValuePtr(plist_str);
+  CFIndex strlen = RSTRING_LEN(plist_str);
+
+  /* Check everything we can before handing the data to CoreFoundation, which
+   * decodes the whole plist in one go. */
+  if (strlen > limits->max_bytes)
+    cfplist_raise_limit("max_bytes", limits->max_bytes);
+  bplist_scan(strdata, strlen, limits);
 
   /* Create a CFDataRef with the data from the string */
   CFDataRef plist_data;
@@ -622,28 +2173,118 @@ plist_parse(int argc, VALUE *argv, VALUE self)
   plist = CFPropertyListCreateWithData(kCFAllocatorDefault, plist_data,
                                        kCFPropertyListImmutable, NULL, &err);
 
+  /* the plist doesn't need the data once it has been created */
+  if (plist_data != NULL)
+    CFRelease(plist_data); /* matches initial create */
+
   /* check to make sure no error occured */
   if (err != NULL) {
     /* if an error did occur, clean up our references */
     if (plist != NULL)
       CFRelease(plist); /* matches initial create */
-    if (plist_data != NULL)
-      CFRelease(plist_data); /* matches initial create */
     rb_raise_CFError(err);
   }
 
-  /* Convert the CFPropertyListRef to a ruby object */
-  VALUE result = cfplist_to_ruby(plist, symbolize_keys);
+  return plist;
+}
 
-  /* clean up our references */
-  if (plist != NULL)
-    CFRelease(plist);
-  if (plist_data != NULL)
-    CFRelease(plist_data);
-  if (err != NULL)
-    CFRelease(err);
+/* Arguments for plist_parse_convert() and plist_parse_release(). */
+struct plist_parse_args {
+  CFPropertyListRef plist;
+  Boolean symbolize_keys;
+  struct cfplist_limits *limits;
+};
 
-  return result;
+/* Converts the parsed plist to ruby. Run under rb_ensure, since the limits
+ * may raise part way through. */
+static VALUE
+plist_parse_convert(VALUE arg)
+{
+  struct plist_parse_args *args = (struct plist_parse_args *)arg;
+  return cfplist_to_ruby(args->plist, args->symbolize_keys, args->limits);
+}
+
+/* Releases the reference held by plist_parse(). */
+static VALUE
+plist_parse_release(VALUE arg)
+{
+  struct plist_parse_args *args = (struct plist_parse_args *)arg;
+
+  if (args->plist != NULL)
+    CFRelease(args->plist);
+
+  return Qnil;
+}
+
+/**
+ * Parses a string representation of a PList to a ruby hash.
+ *
+ * Called as `_parse(plist_str, symbolize_keys = false, opts = nil)`, where
+ * `opts` may hold any of the resource limits described on CFPlist.parse.
+ */
+static VALUE
+plist_parse(int argc, VALUE *argv, VALUE self)
+{
+  VALUE plist_str, v_symbolize_keys, opts;
+  Boolean symbolize_keys;
+  struct cfplist_limits limits;
+
+  rb_scan_args(argc, argv, "12", &plist_str, &v_symbolize_keys, &opts);
+
+  if (NIL_P(v_symbolize_keys) || v_symbolize_keys == Qfalse) {
+    symbolize_keys = false;
+  } else {
+    symbolize_keys = true;
+  }
+
+  cfplist_limits_init(&limits, opts);
+
+  /* Convert the CFPropertyListRef to a ruby object, releasing our reference
+   * whether or not that succeeds. */
+  struct plist_parse_args args;
+  args.plist = plist_create(plist_str, &limits);
+  args.symbolize_keys = symbolize_keys;
+  args.limits = &limits;
+
+  return rb_ensure(plist_parse_convert, (VALUE)&args, plist_parse_release,
+                   (VALUE)&args);
+}
+
+/**
+ * Reads a :format option (:xml or :binary, defaulting to :xml).
+ */
+static CFPropertyListFormat
+plist_format_opt(VALUE format)
+{
+  if (NIL_P(format))
+    return kCFPropertyListXMLFormat_v1_0;
+
+  if (SYMBOL_P(format)) {
+    ID id = SYM2ID(format);
+    if (id == id_xml)
+      return kCFPropertyListXMLFormat_v1_0;
+    if (id == id_binary)
+      return kCFPropertyListBinaryFormat_v1_0;
+  }
+
+  rb_raise(rb_eArgError, "unknown plist format: %" PRIsVALUE,
+           rb_inspect(format));
+}
+
+/**
+ * Generates the canonical encoding of `obj` as a ruby string.
+ */
+static VALUE
+plist_generate_canonical(VALUE obj, CFPropertyListFormat format)
+{
+  struct cfplist_sink sink;
+  MEMZERO(&sink, struct cfplist_sink, 1);
+
+  sink.write = cfplist_str_write;
+  sink.str = rb_str_buf_new(0);
+
+  canonical_write(&sink, obj, format);
+  return sink.str;
 }
 
 static VALUE
@@ -660,41 +2301,133 @@ plist_generate(int argc, VALUE *argv, VALUE self)
   /* opts will be nil (rather than {}) if no option hash was passed. */
   if (NIL_P(opts))
     opts = rb_hash_new();
+  Check_Type(opts, T_HASH);
+
+  CFPropertyListFormat format =
+      plist_format_opt(rb_hash_lookup2(opts, ID2SYM(id_format), Qnil));
+
+  /* Canonical output doesn't go through CoreFoundation at all */
+  if (RTEST(rb_hash_lookup2(opts, ID2SYM(id_canonical), Qfalse)))
+    return plist_generate_canonical(obj, format);
 
-  /* opts is currently reserved for future use, and we don't actually respect
-   * any options passed. */
   CFPropertyListRef obj_as_plist;
   CFErrorRef error = NULL;
-  CFDataRef xml_data;
+  CFDataRef plist_data;
 
   obj_as_plist = ruby_to_cfplist(obj);
-  xml_data = CFPropertyListCreateData(kCFAllocatorDefault, obj_as_plist,
-                                      kCFPropertyListXMLFormat_v1_0, 0, &error);
+  plist_data = CFPropertyListCreateData(kCFAllocatorDefault, obj_as_plist,
+                                      format, 0, &error);
 
   /* Check to make sure no error occured */
   if (error != NULL) {
     /* if an error did occur, clean up the refs */
     if (obj_as_plist != NULL)
       CFRelease(obj_as_plist);
-    if (xml_data != NULL)
-      CFRelease(xml_data);
+    if (plist_data != NULL)
+      CFRelease(plist_data);
     rb_raise_CFError(error);
   }
 
   /* Convert the CFData object to a ruby string */
-  VALUE result = rb_CFData_convert(xml_data);
+  VALUE result = rb_CFData_convert(plist_data, NULL);
 
   /* clean up references */
   if (obj_as_plist != NULL)
     CFRelease(obj_as_plist);
-  if (xml_data != NULL)
-    CFRelease(xml_data);
+  if (plist_data != NULL)
+    CFRelease(plist_data);
   if (error != NULL)
     CFRelease(error);
 
   return result;
 }
 
+/**
+ * Computes a digest of the canonical encoding of an object, without building
+ * the encoded plist in memory. Returns the digest as a hex string.
+ *
+ * Called as `_digest(obj, algorithm = :sha256, format = :xml)`.
+ */
+static VALUE
+plist_digest(int argc, VALUE *argv, VALUE self)
+{
+  VALUE obj, v_algorithm, v_format;
+  struct cfplist_sink sink;
+  uint8_t md[CC_SHA512_DIGEST_LENGTH];
+  size_t i, mdlen;
+  ID algorithm;
+
+  rb_scan_args(argc, argv, "12", &obj, &v_algorithm, &v_format);
+
+  CFPropertyListFormat format = plist_format_opt(v_format);
+  algorithm = NIL_P(v_algorithm) ? id_sha256 : rb_to_id(v_algorithm);
+
+  MEMZERO(&sink, struct cfplist_sink, 1);
+  if (algorithm == id_sha1) {
+    CC_SHA1_Init(&sink.ctx.sha1);
+    sink.write = cfplist_sha1_write;
+  } else if (algorithm == id_sha256) {
+    CC_SHA256_Init(&sink.ctx.sha256);
+    sink.write = cfplist_sha256_write;
+  } else if (algorithm == id_sha512) {
+    CC_SHA512_Init(&sink.ctx.sha512);
+    sink.write = cfplist_sha512_write;
+  } else {
+    rb_raise(rb_eArgError, "unknown digest algorithm: %" PRIsVALUE,
+             rb_inspect(v_algorithm));
+  }
+
+  canonical_write(&sink, obj, format);
+
+  if (algorithm == id_sha1) {
+    CC_SHA1_Final(md, &sink.ctx.sha1);
+    mdlen = CC_SHA1_DIGEST_LENGTH;
+  } else if (algorithm == id_sha256) {
+    CC_SHA256_Final(md, &sink.ctx.sha256);
+    mdlen = CC_SHA256_DIGEST_LENGTH;
+  } else {
+    CC_SHA512_Final(md, &sink.ctx.sha512);
+    mdlen = CC_SHA512_DIGEST_LENGTH;
+  }
+
+  /* hex encode the digest */
+  static const char hex[] = "0123456789abcdef";
+  VALUE result = rb_usascii_str_new(NULL, (long)mdlen * 2);
+  char *out = RSTRING_PTR(result);
+  for (i = 0; i < mdlen; i++) {
+    out[2 * i] = hex[md[i] >> 4];
+    out[2 * i + 1] = hex[md[i] & 0x0F];
+  }
+
+  return result;
+}
+
+/**
+ * Compares two serialized plists, returning an array of changes.
+ *
+ * Called as `_diff(old_str, new_str, opts = nil)`, where `opts` may hold any
+ * of the resource limits described on CFPlist.parse.
+ */
+static VALUE
+plist_diff(int argc, VALUE *argv, VALUE self)
+{
+  VALUE old_str, new_str, opts;
+  struct cfplist_limits limits;
+  struct plist_diff diff;
+
+  rb_scan_args(argc, argv, "21", &old_str, &new_str, &opts);
+  cfplist_limits_init(&limits, opts);
+
+  MEMZERO(&diff, struct plist_diff, 1);
+  diff.old_str = old_str;
+  diff.new_str = new_str;
+  diff.changes = rb_ary_new();
+  diff.path = rb_ary_new();
+  diff.limits = &limits;
+
+  return rb_ensure(diff_run, (VALUE)&diff, diff_release, (VALUE)&diff);
+}
+
 void
 Init_cfplist(void)
 {
@@ -702,6 +2435,24 @@ Init_cfplist(void)
   id_keys = rb_intern("keys");
   id_vals = rb_intern("values");
   id_count = rb_intern("count");
+  id_lshift = rb_intern("<<");
+  id_max_bytes = rb_intern("max_bytes");
+  id_max_objects = rb_intern("max_objects");
+  id_max_string_bytes = rb_intern("max_string_bytes");
+  id_max_depth = rb_intern("max_depth");
+  id_max_total_output = rb_intern("max_total_output");
+  id_format = rb_intern("format");
+  id_canonical = rb_intern("canonical");
+  id_xml = rb_intern("xml");
+  id_binary = rb_intern("binary");
+  id_sha1 = rb_intern("sha1");
+  id_sha256 = rb_intern("sha256");
+  id_sha512 = rb_intern("sha512");
+  id_added = rb_intern("added");
+  id_removed = rb_intern("removed");
+  id_changed = rb_intern("changed");
+
+  enc_utf16be = rb_enc_find("UTF-16BE");
 
   rb_mCFPlist = rb_define_module("CFPlist");
   rb_eCFError =
@@ -712,7 +2463,13 @@ Init_cfplist(void)
       rb_define_class_under(rb_mCFPlist, "MachError", rb_eCFError);
   rb_eCFErrorCocoa =
       rb_define_class_under(rb_mCFPlist, "CocoaError", rb_eCFError);
+  rb_eCFErrorLimit =
+      rb_define_class_under(rb_mCFPlist, "LimitError", rb_eCFError);
+  rb_eCFErrorFormat =
+      rb_define_class_under(rb_mCFPlist, "FormatError", rb_eCFError);
 
   rb_define_module_function(rb_mCFPlist, "_parse", plist_parse, -1);
   rb_define_module_function(rb_mCFPlist, "_generate", plist_generate, -1);
+  rb_define_module_function(rb_mCFPlist, "_digest", plist_digest, -1);
+  rb_define_module_function(rb_mCFPlist, "_diff", plist_diff, -1);
 }
@@ -17,15 +17,61 @@ module CFPlist
 
 module_function
 
+  # Parses the XML or binary property list in _data_.
+  #
+  # The following options bound the work done for untrusted input. Each is an
+  # Integer, and is unlimited if not given. Exceeding one raises a
+  # CFPlist::LimitError, and a binary plist containing a reference cycle raises
+  # a CFPlist::FormatError.
+  #
+  # * +max_bytes+ - size of _data_.
+  # * +max_objects+ - number of decoded objects, including dictionary keys.
+  # * +max_string_bytes+ - size of any one string or data object.
+  # * +max_depth+ - nesting depth of arrays and dictionaries.
+  # * +max_total_output+ - combined size of all strings and data objects.
   def parse(data, opts = {})
     symbolize_keys = opts.fetch(:symbolize_keys, false)
-    _parse(data, symbolize_keys)
+    _parse(data, symbolize_keys, opts)
   end
 
+  # Generates a property list from _obj_, which should be an Array or a Hash.
+  #
+  # * +format+ - +:xml+ (the default) or +:binary+.
+  # * +canonical+ - if true, equal objects always generate the same bytes.
+  #   Dictionary keys are sorted, numbers and dates (truncated to whole
+  #   seconds, in UTC) are written in a single normalized form, and binary
+  #   plists never share objects.
   def generate(obj, opts = {})
     _generate(obj, opts)
   end
 
+  # Returns the hex digest of the canonical encoding of _obj_ (see
+  # {#generate}), without building the encoded plist in memory.
+  #
+  # * +algorithm+ - +:sha1+, +:sha256+ (the default) or +:sha512+.
+  # * +format+ - +:xml+ (the default) or +:binary+.
+  def digest(obj, opts = {})
+    _digest(obj, opts.fetch(:algorithm, :sha256), opts.fetch(:format, :xml))
+  end
+
+  # Compares the XML or binary property lists in _old_data_ and _new_data_,
+  # and returns their differences as an Array of:
+  #
+  #   [:added, path, new_value]
+  #   [:removed, path, old_value]
+  #   [:changed, path, old_value, new_value]
+  #
+  # where _path_ is an Array of the dictionary keys and array indices leading
+  # to the value. Dictionary entries are matched by key, and array elements by
+  # index. Subtrees that are the same in both are skipped without being
+  # converted to ruby objects.
+  #
+  # Accepts the same resource limits as {#parse}, which apply to each input
+  # and to the values in the result.
+  def diff(old_data, new_data, opts = {})
+    _diff(old_data, new_data, opts)
+  end
+
   class << self
     # Default options for {#load}.
     # Initially:
@@ -1,5 +1,7 @@
 # frozen_string_literal: true
 
+require "digest"
+
 RSpec.describe CFPlist do
   let(:dict_data) { fixtures("example-dict.plist").read }
   let(:array_data) { fixtures("example-array.plist").read }
@@ -31,6 +33,71 @@ RSpec.describe CFPlist do
       plist = described_class.parse(dict_data, symbolize_keys: true)
       expect(plist[:FirstName]).to eq "John"
     end
+
+    context "with resource limits" do
+      # Each array refers to the next one twice, so this expands to 2**30
+      # strings if decoded.
+      let(:expanding) do
+        arrays = (1..30).map { |i| [0xA2, i, i].pack("C*") }
+        bplist(*arrays, "\x51a")
+      end
+
+      it "raises a LimitError if the input exceeds :max_bytes" do
+        expect { described_class.parse(dict_data, max_bytes: 64) }.to \
+          raise_error(CFPlist::LimitError, /max_bytes/)
+      end
+
+      it "raises a LimitError if the input exceeds :max_objects" do
+        expect { described_class.parse(dict_data, max_objects: 4) }.to \
+          raise_error(CFPlist::LimitError, /max_objects/)
+      end
+
+      it "raises a LimitError if the input exceeds :max_depth" do
+        expect { described_class.parse(dict_data, max_depth: 0) }.to \
+          raise_error(CFPlist::LimitError, /max_depth/)
+      end
+
+      it "raises a LimitError if a string exceeds :max_string_bytes" do
+        expect { described_class.parse(dict_data, max_string_bytes: 8) }.to \
+          raise_error(CFPlist::LimitError, /max_string_bytes/)
+      end
+
+      it "raises a LimitError if the input exceeds :max_total_output" do
+        expect { described_class.parse(dict_data, max_total_output: 64) }.to \
+          raise_error(CFPlist::LimitError, /max_total_output/)
+      end
+
+      it "parses the plist if it is within the limits" do
+        plist = described_class.parse(dict_data, max_objects: 19, max_depth: 1)
+        expect(plist["FirstName"]).to eq "John"
+      end
+
+      it "raises an ArgumentError for a negative limit" do
+        expect { described_class.parse(dict_data, max_depth: -1) }.to \
+          raise_error(ArgumentError)
+      end
+
+      it "raises a LimitError before expanding shared binary objects" do
+        expect { described_class.parse(expanding, max_objects: 10_000) }.to \
+          raise_error(CFPlist::LimitError, /max_objects/)
+      end
+
+      it "checks :max_depth through shared binary objects" do
+        expect { described_class.parse(expanding, max_depth: 29) }.to \
+          raise_error(CFPlist::LimitError, /max_depth/)
+      end
+
+      it "checks :max_total_output through shared binary objects" do
+        expect { described_class.parse(expanding, max_total_output: 1 << 20) }
+          .to raise_error(CFPlist::LimitError, /max_total_output/)
+      end
+
+      it "raises a FormatError for a binary reference cycle" do
+        cyclic = bplist([0xA1, 1].pack("C*"), [0xA1, 0].pack("C*"))
+        expect { described_class.parse(cyclic) }.to \
+          raise_error(CFPlist::FormatError, /cycle/)
+      end
+    end
   end
 
   describe ".load" do
@@ -69,6 +136,177 @@ RSpec.describe CFPlist do
           match %r{<key>AreaCode</key>\s+<string>555</string>}
       end
     end
+
+    context "when passed format: :binary" do
+      it "generates a binary plist" do
+        expect(described_class.generate([1, "two"], format: :binary)).to \
+          start_with "bplist00"
+      end
+    end
+
+    context "when passed canonical: true" do
+      let(:hash) do
+        {
+          "b" => [1, -2, 70_000, Time.at(1_600_000_000.75)],
+          :a => { "x<&>" => "h\u00e9llo", "z" => true, "y" => false }
+        }
+      end
+      let(:reordered) { hash.to_a.reverse.to_h }
+
+      %i[xml binary].each do |format|
+        it "generates the same #{format} for hashes in any order" do
+          expect(described_class.generate(hash, canonical: true,
+                                                format: format)).to \
+            eq described_class.generate(reordered, canonical: true,
+                                                   format: format)
+        end
+
+        it "generates #{format} that parses back to the same data" do
+          data = described_class.generate(hash, canonical: true, format: format)
+          expect(described_class.parse(data)).to eq(
+            "a" => { "x<&>" => "h\u00e9llo", "y" => false, "z" => true },
+            "b" => [1, -2, 70_000, Time.at(1_600_000_000)]
+          )
+        end
+
+        it "generates the same #{format} for 0.0 and -0.0" do
+          expect(described_class.generate([-0.0], canonical: true,
+                                                  format: format)).to \
+            eq described_class.generate([0.0], canonical: true, format: format)
+        end
+      end
+
+      # 256 objects need 2-byte object refs, and the offset table of the
+      # booleans starts past byte 255 even though the array itself doesn't.
+      [(1..255).map(&:to_s), Array.new(150, true)].each do |array|
+        it "generates binary that parses back for #{array.size} elements" do
+          data = described_class.generate(array, canonical: true,
+                                                 format: :binary)
+          expect(described_class.parse(data)).to eq array
+        end
+      end
+
+      it "sorts dictionary keys" do
+        expect(described_class.generate(hash, canonical: true)).to \
+          match %r{<key>a</key>.*<key>b</key>}m
+      end
+
+      it "raises an ArgumentError for keys that convert to the same string" do
+        expect { described_class.generate({ a: 1, "a" => 2 }, canonical: true) }
+          .to raise_error(ArgumentError, /duplicate/)
+      end
+
+      it "raises a TypeError for values with no plist type, like nil" do
+        expect { described_class.generate([nil], canonical: true) }.to \
+          raise_error(TypeError)
+      end
+    end
+  end
+
+  describe ".digest" do
+    let(:array) { [1, "two", { "c" => 13, "b" => [3.5] }] }
+
+    it "is the SHA-256 of the canonical XML by default" do
+      xml = described_class.generate(array, canonical: true)
+      expect(described_class.digest(array)).to eq Digest::SHA256.hexdigest(xml)
+    end
+
+    it "uses the requested algorithm and format" do
+      binary = described_class.generate(array, canonical: true, format: :binary)
+      expect(described_class.digest(array, algorithm: :sha512,
+                                           format: :binary)).to \
+        eq Digest::SHA512.hexdigest(binary)
+    end
+
+    it "raises an ArgumentError for an unknown algorithm" do
+      expect { described_class.digest(array, algorithm: :md4) }.to \
+        raise_error(ArgumentError, /md4/)
+    end
+  end
+
+  describe ".diff" do
+    let(:old_hash) do
+      { "port" => 80, "tags" => %w[a b], "nested" => { "x" => 1, "y" => true } }
+    end
+    let(:new_hash) do
+      { "port" => 8080, "tags" => %w[a c d], "nested" => { "x" => 1 },
+        "name" => "web" }
+    end
+    let(:old_data) { described_class.generate(old_hash, format: :binary) }
+    let(:new_data) { described_class.generate(new_hash) }
+
+    it "returns no changes for equal plists" do
+      binary = described_class.generate(old_hash, format: :binary)
+      expect(described_class.diff(described_class.generate(old_hash), binary))
+        .to eq []
+    end
+
+    it "reports changes by path, sorted by key and index" do
+      expect(described_class.diff(old_data, new_data)).to eq [
+        [:added, ["name"], "web"],
+        [:removed, %w[nested y], true],
+        [:changed, ["port"], 80, 8080],
+        [:changed, ["tags", 1], "b", "c"],
+        [:added, ["tags", 2], "d"]
+      ]
+    end
+
+    it "ignores the order dictionary entries are stored in" do
+      # { "a" => 1, "b" => 2 }, with its entries stored in either order
+      old_data, new_data = [[1, 2, 3, 4], [2, 1, 4, 3]].map do |refs|
+        bplist([0xD2, *refs].pack("C*"), "\x51a", "\x51b", "\x10\x01",
+               "\x10\x02")
+      end
+      expect(described_class.diff(old_data, new_data)).to eq []
+    end
+
+    it "compares strings with NULs in them" do
+      old_data, new_data = ["a\0b", "a\0c"].map do |str|
+        described_class.generate([[str]], format: :binary)
+      end
+      expect(described_class.diff(old_data, new_data)).to \
+        eq [[:changed, [0, 0], "a\0b", "a\0c"]]
+    end
+
+    it "doesn't skip changes to strings with unpaired surrogates" do
+      # ["\uD800a"] and ["\uD800b"], which can't be converted to UTF-8. Parsing
+      # either one raises, so reporting the change does too.
+      old_data, new_data = [0x61, 0x62].map do |char|
+        bplist([0xA1, 1].pack("C*"), [0x62, 0xD8, 0, 0, char].pack("C*"))
+      end
+      expect { described_class.diff(old_data, new_data) }.to \
+        raise_error(RuntimeError, /UTF8/)
+    end
+
+    it "compares integers too big for 64 bits" do
+      # binary plists store these as 16-byte integers
+      old_data, new_data = [2**63, 2**64 - 1].map do |int|
+        bplist([0xA1, 1].pack("C*"), [0x14, 0, int].pack("CQ>Q>"))
+      end
+      expect(described_class.diff(old_data, new_data)).to \
+        eq [[:changed, [0], 2**63, 2**64 - 1]]
+    end
+
+    it "reports a change of type at the root" do
+      expect(described_class.diff(described_class.generate([1]), new_data))
+        .to eq [[:changed, [], [1], new_hash]]
+    end
+
+    it "applies the resource limits to binary input" do
+      expect { described_class.diff(old_data, new_data, max_objects: 4) }.to \
+        raise_error(CFPlist::LimitError, /max_objects/)
+    end
+
+    it "applies the resource limits to XML input" do
+      expect { described_class.diff(new_data, new_data, max_depth: 1) }.to \
+        raise_error(CFPlist::LimitError, /max_depth/)
+    end
+
+    it "applies the resource limits to each input on its own" do
+      # 13 and 14 objects, so only the two together exceed the limit
+      expect { described_class.diff(old_data, new_data, max_objects: 14) }
+        .not_to raise_error
+    end
   end
 
   describe ".dump" do
@@ -3,6 +3,7 @@
 require "bundler/setup"
 require "simplecov"
 require "cfplist"
+require "support/bplist"
 require "support/path"
 
 # This file was generated by the `rspec --init` command. Conventionally, all
@@ -23,6 +24,7 @@ require "support/path"
 RSpec.configure do |config|
   # Use our spec/support modules
   config.include Spec::Path
+  config.include Spec::BPlist
 
   # rspec-expectations config goes here. You can use an alternate
   # assertion/expectation library such as wrong or the stdlib/minitest
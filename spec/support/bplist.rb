@@ -0,0 +1,15 @@
+# frozen_string_literal: true
+
+module Spec
+  module BPlist
+    # Assembles a binary plist from already-encoded objects, using one byte
+    # offsets and object refs. The first object is the top object.
+    def bplist(*objects)
+      data = +"bplist00".b
+      offsets = objects.map { |obj| data.size.tap { data << obj.b } }
+      table = data.size
+      data << offsets.pack("C*")
+      data << [1, 1, objects.size, 0, table].pack("x6CCQ>Q>Q>")
+    end
+  end
+end